@@ -0,0 +1,342 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <setjmp.h>
+#include <unistd.h>
+#include <pthread.h>
+#ifdef __linux__
+#include <sched.h>
+#endif
+#include "gba.h"
+#include "input_script.h"
+#include "hash.h"
+
+#define MAX_JOB_LINE 1024
+#define CACHE_LINE_SIZE 64
+
+typedef struct {
+    char *rom_file;
+    char *input_file;
+    int num_frames;
+    InputEvent *events;
+    int num_events;
+} Job;
+
+typedef enum {
+    JOB_OK,
+    JOB_FAILED
+} JobStatus;
+
+// only written by the worker that ran the job, padded so neighbouring jobs' results never share a line
+typedef struct {
+    JobStatus status;
+    int frames_run;
+    uint64_t hash; // of the last frame
+    double seconds;
+} __attribute__((aligned(CACHE_LINE_SIZE))) JobResult;
+
+// the jobs a worker hasn't started yet, [top, bottom) packed into one word so that the owner (taking from
+// the bottom) and thieves (taking from the top) claim a job with a single compare and swap. no jobs are
+// ever added once the workers start, so a worker is done once every deque is empty
+typedef struct {
+    uint64_t range; // top in the low 32 bits, bottom in the high 32 bits
+} __attribute__((aligned(CACHE_LINE_SIZE))) JobDeque;
+
+typedef struct {
+    int index;
+    int cpu; // -1 if not pinned
+    pthread_t thread;
+} Worker;
+
+static Job *jobs;
+static int num_jobs;
+static JobResult *results;
+
+static JobDeque *deques;
+static int num_workers;
+
+static const char *bios_file = "bios.bin";
+static int frame_skip = 0;
+static int frame_skip_period = 1;
+static bool use_bg_cache = false;
+static bool use_catch_up_ppu = false;
+
+static void usage(void) {
+    fprintf(stderr,
+        "usage: gbac-batch [options] <job_file>\n"
+        "  --bios <file>            BIOS image (default bios.bin)\n"
+        "  --threads <n>            number of worker threads (default one per available core)\n"
+        "  --no-pin                 don't pin worker threads to cores\n"
+        "  --frame-skip <n>/<m>     skip drawing n of every m frames (emulation is unaffected)\n"
+        "  --no-render              never draw frames, only emulate\n"
+        "  --bg-cache, --catch-up-ppu\n"
+        "                           same as for gbac\n"
+        "each line of the job file is \"<rom_file> <frames> [input_script]\"\n");
+    exit(1);
+}
+
+// blank lines and lines starting with # are ignored. input scripts are all loaded up front so that a
+// bad one is reported before anything runs
+static void load_jobs(const char *job_file) {
+    FILE *fp = fopen(job_file, "r");
+    if (fp == NULL) {
+        fprintf(stderr, "ERROR: failed to open job file %s\n", job_file);
+        exit(1);
+    }
+
+    int capacity = 0;
+    char line[MAX_JOB_LINE];
+    int line_number = 0;
+
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        line_number++;
+
+        char *rom_file = strtok(line, " \t\r\n");
+        if ((rom_file == NULL) || (rom_file[0] == '#'))
+            continue;
+
+        char *frames = strtok(NULL, " \t\r\n");
+        char *input_file = strtok(NULL, " \t\r\n");
+        char *end;
+        long num_frames = frames ? strtol(frames, &end, 10) : 0;
+        if ((frames == NULL) || (*end != '\0') || (num_frames < 1) || (strtok(NULL, " \t\r\n") != NULL)) {
+            fprintf(stderr, "ERROR: %s:%d: expected \"<rom_file> <frames> [input_script]\"\n", job_file, line_number);
+            exit(1);
+        }
+
+        if (num_jobs == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            jobs = realloc(jobs, capacity * sizeof(Job));
+        }
+
+        Job *job = &jobs[num_jobs++];
+        *job = (Job){ strdup(rom_file), input_file ? strdup(input_file) : NULL, (int)num_frames, NULL, 0 };
+        if (input_file != NULL)
+            job->events = load_input_script(input_file, &job->num_events);
+    }
+
+    fclose(fp);
+}
+
+// returns the claimed job, or -1 if the deque is empty
+static int take_job(JobDeque *deque, bool steal) {
+    uint64_t range = __atomic_load_n(&deque->range, __ATOMIC_ACQUIRE);
+
+    for (;;) {
+        uint32_t top = (uint32_t)range;
+        uint32_t bottom = (uint32_t)(range >> 32);
+        if (top == bottom)
+            return -1;
+
+        uint64_t claimed = steal ? (range + 1) : (range - ((uint64_t)1 << 32));
+        if (__atomic_compare_exchange_n(&deque->range, &range, claimed, true, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            return steal ? (int)top : (int)(bottom - 1);
+    }
+}
+
+// the worker's own jobs first, then one at a time from the others, starting with its neighbour
+static int next_job(int worker) {
+    int job = take_job(&deques[worker], false);
+
+    for (int i = 1; (job < 0) && (i < num_workers); i++)
+        job = take_job(&deques[(worker + i) % num_workers], true);
+
+    return job;
+}
+
+// a fatal emulation error only fails the job it happened in. each instance is a separate allocation
+// of several hundred KB and the core's scratch buffers are thread local, so the hot state of instances
+// running side by side doesn't share cache lines. only the ROM image and thumb table are shared, read-only
+static void run_job(const Job *job, JobResult *result) {
+    jmp_buf on_error;
+    double start = gba_now_seconds();
+
+    gba_error_handler = &on_error;
+    if (setjmp(on_error) != 0) {
+        // gba still points at the instance that failed, even if gba_create() never returned it
+        if (gba != NULL)
+            gba_destroy(gba);
+
+        gba_error_handler = NULL;
+        result->status = JOB_FAILED;
+        result->seconds = gba_now_seconds() - start;
+        return;
+    }
+
+    GBA *instance = gba_create(job->rom_file, bios_file);
+    set_frame_skip(frame_skip, frame_skip_period);
+    enable_bg_cache(use_bg_cache);
+    enable_catch_up_ppu(use_catch_up_ppu);
+
+    uint16_t key_input = 0xFFFF;
+    int next_event = 0;
+    uint16_t *frame = NULL;
+
+    for (int frame_number = 1; frame_number <= job->num_frames; frame_number++) {
+        while ((next_event < job->num_events) && (job->events[next_event].frame < frame_number))
+            key_input = job->events[next_event++].keys;
+
+        frame = gba_run_frame(instance, key_input);
+        result->frames_run = frame_number;
+    }
+
+    result->hash = hash_frame(frame);
+    result->status = JOB_OK;
+    result->seconds = gba_now_seconds() - start;
+
+    gba_destroy(instance);
+    gba_error_handler = NULL;
+}
+
+static void *worker_loop(void *arg) {
+    Worker *worker = arg;
+
+#ifdef __linux__
+    if (worker->cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(worker->cpu, &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    }
+#endif
+
+    int job;
+    while ((job = next_job(worker->index)) >= 0)
+        run_job(&jobs[job], &results[job]);
+
+    return NULL;
+}
+
+// the cores the process may run on, in order. without affinity support workers aren't pinned
+static int available_cpus(int *cpus, int max_cpus) {
+#ifdef __linux__
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+        int count = 0;
+        for (int cpu = 0; (cpu < CPU_SETSIZE) && (count < max_cpus); cpu++) {
+            if (CPU_ISSET(cpu, &allowed))
+                cpus[count++] = cpu;
+        }
+        return count;
+    }
+#endif
+    (void)cpus;
+    (void)max_cpus;
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    char *job_file = NULL;
+    int num_threads = 0;
+    bool pin_threads = true;
+
+    for (int i = 1; i < argc; i++) {
+        bool has_value = i + 1 < argc;
+
+        if ((strcmp(argv[i], "--bios") == 0) && has_value) {
+            bios_file = argv[++i];
+        } else if ((strcmp(argv[i], "--threads") == 0) && has_value) {
+            num_threads = atoi(argv[++i]);
+            if (num_threads < 1) usage();
+        } else if (strcmp(argv[i], "--no-pin") == 0) {
+            pin_threads = false;
+        } else if ((strcmp(argv[i], "--frame-skip") == 0) && has_value) {
+            if ((sscanf(argv[++i], "%d/%d", &frame_skip, &frame_skip_period) != 2) || (frame_skip_period < 1) || (frame_skip < 0) || (frame_skip > frame_skip_period))
+                usage();
+        } else if (strcmp(argv[i], "--no-render") == 0) {
+            frame_skip = 1;
+            frame_skip_period = 1;
+        } else if (strcmp(argv[i], "--bg-cache") == 0) {
+            use_bg_cache = true;
+        } else if (strcmp(argv[i], "--catch-up-ppu") == 0) {
+            use_catch_up_ppu = true;
+        } else if ((argv[i][0] == '-') || (job_file != NULL)) {
+            usage();
+        } else {
+            job_file = argv[i];
+        }
+    }
+
+    if (job_file == NULL)
+        usage();
+
+    load_jobs(job_file);
+    if (num_jobs == 0) {
+        fprintf(stderr, "ERROR: no jobs in %s\n", job_file);
+        exit(1);
+    }
+
+    static int cpus[1024];
+    int num_cpus = available_cpus(cpus, 1024);
+
+    if (num_threads == 0)
+        num_threads = (num_cpus > 0) ? num_cpus : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    num_workers = (num_threads < num_jobs) ? num_threads : num_jobs;
+    if (num_workers < 1)
+        num_workers = 1;
+
+    results = aligned_alloc(CACHE_LINE_SIZE, num_jobs * sizeof(JobResult));
+    deques = aligned_alloc(CACHE_LINE_SIZE, num_workers * sizeof(JobDeque));
+    Worker *workers = calloc(num_workers, sizeof(Worker));
+    if ((results == NULL) || (deques == NULL) || (workers == NULL)) {
+        fprintf(stderr, "ERROR: failed to allocate %d jobs\n", num_jobs);
+        exit(1);
+    }
+    memset(results, 0, num_jobs * sizeof(JobResult));
+
+    // jobs start out split into contiguous runs, one per worker
+    for (int i = 0; i < num_workers; i++) {
+        uint64_t top = ((uint64_t)num_jobs * i) / num_workers;
+        uint64_t bottom = ((uint64_t)num_jobs * (i + 1)) / num_workers;
+        deques[i].range = top | (bottom << 32);
+    }
+
+    double start = gba_now_seconds();
+
+    for (int i = 0; i < num_workers; i++) {
+        workers[i] = (Worker){ .index = i, .cpu = (pin_threads && (num_cpus > 0)) ? cpus[i % num_cpus] : -1 };
+        if (pthread_create(&workers[i].thread, NULL, worker_loop, &workers[i]) != 0) {
+            fprintf(stderr, "ERROR: failed to start worker thread\n");
+            exit(1);
+        }
+    }
+
+    for (int i = 0; i < num_workers; i++)
+        pthread_join(workers[i].thread, NULL);
+
+    double seconds = gba_now_seconds() - start;
+
+    // one line per job, in job file order: index, status, frames run, hash of the last frame, frames/sec, rom
+    long long total_frames = 0;
+    int num_failed = 0;
+    for (int i = 0; i < num_jobs; i++) {
+        JobResult *result = &results[i];
+        double fps = (result->seconds > 0) ? (result->frames_run / result->seconds) : 0;
+        total_frames += result->frames_run;
+
+        if (result->status == JOB_OK) {
+            printf("%d ok %d %016llx %.1f %s\n", i, result->frames_run, (unsigned long long)result->hash, fps, jobs[i].rom_file);
+        } else {
+            printf("%d failed %d - %.1f %s\n", i, result->frames_run, fps, jobs[i].rom_file);
+            num_failed++;
+        }
+    }
+
+    printf("%d jobs (%d failed), %lld frames in %.2fs on %d threads: %.1f frames/s\n",
+        num_jobs, num_failed, total_frames, seconds, num_workers, total_frames / seconds);
+
+    for (int i = 0; i < num_jobs; i++) {
+        free(jobs[i].rom_file);
+        free(jobs[i].input_file);
+        free(jobs[i].events);
+    }
+    free(jobs);
+    free(results);
+    free(deques);
+    free(workers);
+
+    return (num_failed == 0) ? 0 : 1;
+}
@@ -0,0 +1,355 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <setjmp.h>
+#include <glob.h>
+#include "gba.h"
+#include "hash.h"
+#include "movie.h"
+
+// what each timed run measures, reported as the median and percentiles over the runs
+typedef enum {
+    METRIC_FPS,
+    METRIC_MIPS,
+    METRIC_ARM_NS,      // per ARM instruction
+    METRIC_THUMB_NS,    // per THUMB instruction
+    METRIC_CPU_SECONDS, // these three include the PPU's per cycle timing, only drawing is told apart
+    METRIC_PPU_DRAW_SECONDS,
+    METRIC_FRONTEND_SECONDS,
+    NUM_METRICS
+} Metric;
+
+static const char *metric_names[NUM_METRICS] = {
+    "frames_per_second",
+    "instructions_per_second",
+    "arm_ns_per_instruction",
+    "thumb_ns_per_instruction",
+    "cpu_seconds",
+    "ppu_draw_seconds",
+    "frontend_seconds",
+};
+
+// a ROM run from power on, or a movie replayed from its start state
+typedef struct {
+    char *rom_file;
+    char *movie_file;
+    Movie *movie;
+} Benchmark;
+
+typedef struct {
+    bool failed;
+    const char *error; // why it failed, if not reported by the core
+    int frames;
+    uint64_t hash; // of every frame run, so that runs can be checked to have emulated the same thing
+    uint64_t arm_instructions;
+    uint64_t thumb_instructions;
+    double (*metrics)[NUM_METRICS]; // per run
+} BenchmarkResult;
+
+static const char *bios_file = "bios.bin";
+static int num_frames = 600;
+static int warmup_frames = 120;
+static int num_runs = 5;
+static int frame_skip = 0;
+static int frame_skip_period = 1;
+static bool use_bg_cache = false;
+static bool use_threaded_ppu = false;
+static bool use_catch_up_ppu = false;
+
+static void usage(void) {
+    fprintf(stderr,
+        "usage: gbac-bench [options] [rom_file...]\n"
+        "  --bios <file>            BIOS image (default bios.bin)\n"
+        "  --frames <n>             frames per timed run of a ROM (default 600)\n"
+        "  --warmup <n>             frames run untimed before the timed runs (default 120)\n"
+        "  --runs <n>               timed runs per benchmark (default 5)\n"
+        "  --replay <movie> <rom_file>\n"
+        "                           also benchmark replaying an input movie, for its whole length\n"
+        "  --out <file>             where to write the JSON report (default stdout)\n"
+        "  --frame-skip <n>/<m>     skip drawing n of every m frames (emulation is unaffected)\n"
+        "  --no-render              never draw frames, only emulate\n"
+        "  --bg-cache, --threaded-ppu, --catch-up-ppu\n"
+        "                           same as for gbac\n"
+        "without any ROM files or movies, every tests/*.gba is run\n");
+    exit(1);
+}
+
+static int parse_count(const char *value, int min) {
+    char *end;
+    long count = strtol(value, &end, 10);
+    if ((*end != '\0') || (count < min))
+        usage();
+    return (int)count;
+}
+
+// back to where every run starts from: power on, or the movie's start state
+static void restart(const Benchmark *benchmark, GBA *instance) {
+    if (benchmark->movie != NULL)
+        movie_start(benchmark->movie, instance);
+    else
+        gba_reset(instance);
+}
+
+static uint16_t keys_for(const Benchmark *benchmark, int frame) {
+    return (benchmark->movie != NULL) ? benchmark->movie->keys[frame] : 0xFFFF;
+}
+
+// the frontend's share of a frame is hashing it, as gbac-headless does
+static void timed_run(const Benchmark *benchmark, GBA *instance, int frames, BenchmarkResult *result, double *metrics) {
+    restart(benchmark, instance);
+
+    FrameProfile total = {0};
+    uint64_t arm_instructions = 0;
+    uint64_t thumb_instructions = 0;
+    double emulating = 0;
+    uint64_t hash = 0;
+
+    double start = gba_now_seconds();
+    for (int frame = 0; frame < frames; frame++) {
+        double frame_start = gba_now_seconds();
+        uint16_t *pixels = gba_run_frame(instance, keys_for(benchmark, frame));
+        emulating += gba_now_seconds() - frame_start;
+
+        arm_instructions += instance->profile.arm_instructions;
+        thumb_instructions += instance->profile.thumb_instructions;
+        total.arm_seconds += instance->profile.arm_seconds;
+        total.thumb_seconds += instance->profile.thumb_seconds;
+        total.ppu_draw_seconds += instance->profile.ppu_draw_seconds;
+
+        hash = (hash * 31) ^ hash_frame(pixels);
+    }
+    double seconds = gba_now_seconds() - start;
+
+    metrics[METRIC_FPS] = frames / seconds;
+    metrics[METRIC_MIPS] = (arm_instructions + thumb_instructions) / seconds;
+    metrics[METRIC_ARM_NS] = arm_instructions ? (total.arm_seconds * 1e9 / arm_instructions) : 0;
+    metrics[METRIC_THUMB_NS] = thumb_instructions ? (total.thumb_seconds * 1e9 / thumb_instructions) : 0;
+    metrics[METRIC_CPU_SECONDS] = total.arm_seconds + total.thumb_seconds;
+    metrics[METRIC_PPU_DRAW_SECONDS] = total.ppu_draw_seconds;
+    metrics[METRIC_FRONTEND_SECONDS] = seconds - emulating;
+
+    result->hash = hash;
+    result->arm_instructions = arm_instructions;
+    result->thumb_instructions = thumb_instructions;
+}
+
+// the warm-up brings the host's caches, branch predictors and the PPU's caches up to speed, then
+// every timed run starts over from the same state
+static void run_benchmark(const Benchmark *benchmark, BenchmarkResult *result) {
+    jmp_buf on_error;
+
+    gba_error_handler = &on_error;
+    if (setjmp(on_error) != 0) {
+        // gba still points at the instance that failed, even if gba_create() never returned it
+        if (gba != NULL)
+            gba_destroy(gba);
+
+        gba_error_handler = NULL;
+        result->failed = true;
+        return;
+    }
+
+    GBA *instance = gba_create(benchmark->rom_file, bios_file);
+    set_frame_skip(frame_skip, frame_skip_period);
+    enable_bg_cache(use_bg_cache);
+    enable_threaded_ppu(use_threaded_ppu);
+    enable_catch_up_ppu(use_catch_up_ppu);
+    enable_profiling(true);
+
+    result->frames = benchmark->movie ? benchmark->movie->num_frames : num_frames;
+
+    restart(benchmark, instance);
+    for (int frame = 0; frame < warmup_frames; frame++)
+        gba_run_frame(instance, keys_for(benchmark, frame % result->frames));
+
+    uint64_t first_hash = 0;
+    for (int run = 0; run < num_runs; run++) {
+        timed_run(benchmark, instance, result->frames, result, result->metrics[run]);
+
+        if (run == 0) {
+            first_hash = result->hash;
+        } else if (result->hash != first_hash) {
+            fprintf(stderr, "ERROR: %s ran differently on run %d than on the first one\n", benchmark->movie_file ? benchmark->movie_file : benchmark->rom_file, run + 1);
+            gba_destroy(instance);
+            gba_error_handler = NULL;
+            result->failed = true;
+            result->error = "ran differently than on the first run";
+            return;
+        }
+    }
+
+    gba_destroy(instance);
+    gba_error_handler = NULL;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// linearly interpolated between the two closest runs
+static double percentile(const double *sorted, int count, double p) {
+    double position = p * (count - 1);
+    int below = (int)position;
+    if (below + 1 >= count)
+        return sorted[count - 1];
+    return sorted[below] + (position - below) * (sorted[below + 1] - sorted[below]);
+}
+
+static void write_json_string(FILE *out, const char *string) {
+    fputc('"', out);
+    for (; *string; string++) {
+        if ((*string == '"') || (*string == '\\'))
+            fputc('\\', out);
+        fputc(*string, out);
+    }
+    fputc('"', out);
+}
+
+static void write_report(FILE *out, const Benchmark *benchmarks, const BenchmarkResult *results, int num_benchmarks) {
+    double *sorted = malloc(num_runs * sizeof(double));
+
+    fprintf(out, "{\n");
+    fprintf(out, "  \"warmup_frames\": %d,\n", warmup_frames);
+    fprintf(out, "  \"runs\": %d,\n", num_runs);
+    fprintf(out, "  \"frame_skip\": \"%d/%d\",\n", frame_skip, frame_skip_period);
+    fprintf(out, "  \"bg_cache\": %s,\n", use_bg_cache ? "true" : "false");
+    fprintf(out, "  \"threaded_ppu\": %s,\n", use_threaded_ppu ? "true" : "false");
+    fprintf(out, "  \"catch_up_ppu\": %s,\n", use_catch_up_ppu ? "true" : "false");
+    fprintf(out, "  \"benchmarks\": [\n");
+
+    for (int i = 0; i < num_benchmarks; i++) {
+        const Benchmark *benchmark = &benchmarks[i];
+        const BenchmarkResult *result = &results[i];
+
+        fprintf(out, "    {\n      \"rom\": ");
+        write_json_string(out, benchmark->rom_file);
+        if (benchmark->movie_file != NULL) {
+            fprintf(out, ",\n      \"movie\": ");
+            write_json_string(out, benchmark->movie_file);
+        }
+
+        if (result->failed) {
+            fprintf(out, ",\n      \"failed\": true");
+            if (result->error != NULL) {
+                fprintf(out, ",\n      \"error\": ");
+                write_json_string(out, result->error);
+            }
+            fprintf(out, "\n    }%s\n", (i + 1 < num_benchmarks) ? "," : "");
+            continue;
+        }
+
+        fprintf(out, ",\n      \"frames\": %d,\n", result->frames);
+        fprintf(out, "      \"hash\": \"%016llx\",\n", (unsigned long long)result->hash);
+        fprintf(out, "      \"arm_instructions\": %llu,\n", (unsigned long long)result->arm_instructions);
+        fprintf(out, "      \"thumb_instructions\": %llu", (unsigned long long)result->thumb_instructions);
+
+        for (int metric = 0; metric < NUM_METRICS; metric++) {
+            for (int run = 0; run < num_runs; run++)
+                sorted[run] = result->metrics[run][metric];
+            qsort(sorted, num_runs, sizeof(double), compare_doubles);
+
+            fprintf(out, ",\n      \"%s\": { \"median\": %.6g, \"p10\": %.6g, \"p90\": %.6g, \"min\": %.6g, \"max\": %.6g }",
+                metric_names[metric], percentile(sorted, num_runs, 0.5), percentile(sorted, num_runs, 0.1),
+                percentile(sorted, num_runs, 0.9), sorted[0], sorted[num_runs - 1]);
+        }
+        fprintf(out, "\n    }%s\n", (i + 1 < num_benchmarks) ? "," : "");
+    }
+
+    fprintf(out, "  ]\n}\n");
+    free(sorted);
+}
+
+int main(int argc, char **argv) {
+    Benchmark *benchmarks = calloc(argc, sizeof(Benchmark));
+    int num_benchmarks = 0;
+    char *out_file = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        bool has_value = i + 1 < argc;
+
+        if ((strcmp(argv[i], "--bios") == 0) && has_value) {
+            bios_file = argv[++i];
+        } else if ((strcmp(argv[i], "--frames") == 0) && has_value) {
+            num_frames = parse_count(argv[++i], 1);
+        } else if ((strcmp(argv[i], "--warmup") == 0) && has_value) {
+            warmup_frames = parse_count(argv[++i], 0);
+        } else if ((strcmp(argv[i], "--runs") == 0) && has_value) {
+            num_runs = parse_count(argv[++i], 1);
+        } else if ((strcmp(argv[i], "--replay") == 0) && (i + 2 < argc)) {
+            char *movie_file = argv[++i];
+            char *rom_file = argv[++i];
+            Movie *movie = movie_load(movie_file);
+            if (movie->num_frames == 0) {
+                fprintf(stderr, "ERROR: %s has no frames to replay\n", movie_file);
+                exit(1);
+            }
+            benchmarks[num_benchmarks++] = (Benchmark){ rom_file, movie_file, movie };
+        } else if ((strcmp(argv[i], "--out") == 0) && has_value) {
+            out_file = argv[++i];
+        } else if ((strcmp(argv[i], "--frame-skip") == 0) && has_value) {
+            if ((sscanf(argv[++i], "%d/%d", &frame_skip, &frame_skip_period) != 2) || (frame_skip_period < 1) || (frame_skip < 0) || (frame_skip > frame_skip_period))
+                usage();
+        } else if (strcmp(argv[i], "--no-render") == 0) {
+            frame_skip = 1;
+            frame_skip_period = 1;
+        } else if (strcmp(argv[i], "--bg-cache") == 0) {
+            use_bg_cache = true;
+        } else if (strcmp(argv[i], "--threaded-ppu") == 0) {
+            use_threaded_ppu = true;
+        } else if (strcmp(argv[i], "--catch-up-ppu") == 0) {
+            use_catch_up_ppu = true;
+        } else if (argv[i][0] == '-') {
+            usage();
+        } else {
+            benchmarks[num_benchmarks++] = (Benchmark){ argv[i], NULL, NULL };
+        }
+    }
+
+    glob_t tests = {0};
+    if (num_benchmarks == 0) {
+        if (glob("tests/*.gba", 0, NULL, &tests) != 0) {
+            fprintf(stderr, "ERROR: no ROMs given and none found in tests/\n");
+            exit(1);
+        }
+        benchmarks = realloc(benchmarks, tests.gl_pathc * sizeof(Benchmark));
+        for (size_t i = 0; i < tests.gl_pathc; i++)
+            benchmarks[num_benchmarks++] = (Benchmark){ tests.gl_pathv[i], NULL, NULL };
+    }
+
+    BenchmarkResult *results = calloc(num_benchmarks, sizeof(BenchmarkResult));
+    int status = 0;
+    for (int i = 0; i < num_benchmarks; i++) {
+        results[i].metrics = calloc(num_runs, sizeof(*results[i].metrics));
+
+        fprintf(stderr, "%s...\n", benchmarks[i].movie_file ? benchmarks[i].movie_file : benchmarks[i].rom_file);
+        run_benchmark(&benchmarks[i], &results[i]);
+        if (results[i].failed) {
+            fprintf(stderr, "ERROR: %s failed\n", benchmarks[i].rom_file);
+            status = 1;
+        }
+    }
+
+    FILE *out = out_file ? fopen(out_file, "w") : stdout;
+    if (out == NULL) {
+        fprintf(stderr, "ERROR: failed to open %s\n", out_file);
+        exit(1);
+    }
+    write_report(out, benchmarks, results, num_benchmarks);
+    if (out != stdout)
+        fclose(out);
+
+    for (int i = 0; i < num_benchmarks; i++) {
+        if (benchmarks[i].movie != NULL)
+            movie_destroy(benchmarks[i].movie);
+        free(results[i].metrics);
+    }
+    free(results);
+    free(benchmarks);
+    globfree(&tests);
+
+    return status;
+}
@@ -1,9 +1,11 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <pthread.h>
 #include "cpu.h"
 #include "decompressor.h"
 #include "memory.h"
+#include "gba.h"
 
 #define CYCLES_PER_FRAME 280896
 
@@ -19,11 +21,11 @@
 #define LR_REG 0xE
 #define PC_REG 0xF
 
-#define THUMB_ACTIVATED     (registers.cpsr >> 5 & 1)
-#define PROCESSOR_MODE      (registers.cpsr & 0x1F)
+#define THUMB_ACTIVATED     (gba->registers.cpsr >> 5 & 1)
+#define PROCESSOR_MODE      (gba->registers.cpsr & 0x1F)
 
-#define SET_PROCESSOR_MODE(mode)    registers.cpsr &= ~0x1F; \
-                                    registers.cpsr |= (mode);
+#define SET_PROCESSOR_MODE(mode)    gba->registers.cpsr &= ~0x1F; \
+                                    gba->registers.cpsr |= (mode);
 
 // https://problemkaputt.de/gbatek.htm#armcpuflagsconditionfieldcond
 // all ARM instructions start with a 4 bit condition opcode
@@ -38,65 +40,18 @@
 // certain instructions will be aware of the stored value of r15 being
 // two instructions ahead of the currently executed instruction
 // and the returned value of r15 will be + 12 or + 6 respective of the current mode
-#define PC_VALUE (THUMB_ACTIVATED ? registers.r15 + HALFWORD_ACCESS : registers.r15 + WORD_ACCESS)
+#define PC_VALUE (THUMB_ACTIVATED ? gba->registers.r15 + HALFWORD_ACCESS : gba->registers.r15 + WORD_ACCESS)
 
 // used to fix pipeline flush edge case on pc updates
 // that are pointing to PC(+2 FOR THUMB)(+4 FOR ARM)
 // which in the execute stage (for this implementation) r15 = PC (+2/+4 respectively)
 // so just checking before and after execute if PC has changed will not suffice
-#define PC_UPDATE(new_pc)   registers.r15 = new_pc; \ 
-                            pipeline = 0; \
+#define PC_UPDATE(new_pc)   gba->registers.r15 = new_pc; \ 
+                            gba->pipeline = 0; \
 
 static Word get_reg(uint8_t reg_id);
 static Word get_psr_reg(void);
 
-typedef struct {
-    Word r0;
-    Word r1;
-    Word r2;
-    Word r3;
-    Word r4;
-    Word r5;
-    Word r6;
-    Word r7;
-    Word r8;
-    Word r9;
-    Word r10;
-    Word r11;
-    Word r12;
-
-    Word r13;  // SP (Stack pointer)
-    Word r14;  // LR (Link register)
-    Word r15;  // PC (Program counter)
-    Word r8_fiq;
-    Word r9_fiq;
-    Word r10_fiq;
-    Word r11_fiq;
-    Word r12_fiq;
-    Word r13_fiq;
-    Word r14_fiq;
-    Word r13_svc;
-    Word r14_svc;
-    Word r13_abt;
-    Word r14_abt;
-    Word r13_irq;
-    Word r14_irq;
-    Word r13_und;
-    Word r14_und;
-
-    Word cpsr;
-    Word spsr_fiq;
-    Word spsr_svc;
-    Word spsr_abt;
-    Word spsr_irq;
-    Word spsr_und;
-} RegisterSet;
-
-RegisterSet registers;
-Word curr_instr;
-Word pipeline;
-uint8_t shifter_carry;
-
 char* cond_to_cstr(uint8_t opcode) {
     switch (opcode) {
     case 0x0: return "EQ";
@@ -167,10 +122,10 @@ void print_dump(void) {
     for (int i = 0; i < 16; i++) {
         printf("r%d: %08X\n", i, get_reg(i));
     }
-    printf("cpsr: %08X\n", registers.cpsr);
+    printf("cpsr: %08X\n", gba->registers.cpsr);
     printf("current psr: %08X\n", get_psr_reg());
-    if (pipeline) {
-        printf("pipeline (next instruction): %08X\n", pipeline);
+    if (gba->pipeline) {
+        printf("pipeline (next instruction): %08X\n", gba->pipeline);
     } else {
         printf("PIPELINE FLUSH, RE-FILL");
     }
@@ -180,12 +135,12 @@ void print_dump(void) {
 static Word get_psr_reg(void) {
     switch (PROCESSOR_MODE) {
     case User:
-    case System: return registers.cpsr;
-    case FIQ: return registers.spsr_fiq;
-    case IRQ: return registers.spsr_irq;
-    case Supervisor: return registers.spsr_svc;
-    case Abort: return registers.spsr_abt;
-    case Undefined: return registers.spsr_und;
+    case System: return gba->registers.cpsr;
+    case FIQ: return gba->registers.spsr_fiq;
+    case IRQ: return gba->registers.spsr_irq;
+    case Supervisor: return gba->registers.spsr_svc;
+    case Abort: return gba->registers.spsr_abt;
+    case Undefined: return gba->registers.spsr_und;
     }
 }
 
@@ -193,22 +148,22 @@ static void set_psr_reg(Word val) {
     switch (PROCESSOR_MODE) {
     case User:
     case System:
-        registers.cpsr = val;
+        gba->registers.cpsr = val;
         break;
     case FIQ:
-        registers.spsr_fiq = val;
+        gba->registers.spsr_fiq = val;
         break;
     case IRQ:
-        registers.spsr_irq = val;
+        gba->registers.spsr_irq = val;
         break;
     case Supervisor:
-        registers.spsr_svc = val;
+        gba->registers.spsr_svc = val;
         break;
     case Abort:
-        registers.spsr_abt = val;
+        gba->registers.spsr_abt = val;
         break;
     case Undefined:
-        registers.spsr_und = val;
+        gba->registers.spsr_und = val;
         break;
     }
 }
@@ -255,170 +210,170 @@ static bool eval_cond(uint8_t opcode) {
 
 static Word get_reg(uint8_t reg_id) {
     switch (reg_id) {
-    case 0x0: return registers.r0;
-    case 0x1: return registers.r1;
-    case 0x2: return registers.r2;
-    case 0x3: return registers.r3;
-    case 0x4: return registers.r4;
-    case 0x5: return registers.r5;
-    case 0x6: return registers.r6;
-    case 0x7: return registers.r7;
+    case 0x0: return gba->registers.r0;
+    case 0x1: return gba->registers.r1;
+    case 0x2: return gba->registers.r2;
+    case 0x3: return gba->registers.r3;
+    case 0x4: return gba->registers.r4;
+    case 0x5: return gba->registers.r5;
+    case 0x6: return gba->registers.r6;
+    case 0x7: return gba->registers.r7;
     case 0x8:
-        if (PROCESSOR_MODE == FIQ) return registers.r8_fiq;
-        return registers.r8;
+        if (PROCESSOR_MODE == FIQ) return gba->registers.r8_fiq;
+        return gba->registers.r8;
     case 0x9:
-        if (PROCESSOR_MODE == FIQ) return registers.r9_fiq;
-        return registers.r9;
+        if (PROCESSOR_MODE == FIQ) return gba->registers.r9_fiq;
+        return gba->registers.r9;
     case 0xA:
-        if (PROCESSOR_MODE == FIQ) return registers.r10_fiq;
-        return registers.r10;
+        if (PROCESSOR_MODE == FIQ) return gba->registers.r10_fiq;
+        return gba->registers.r10;
     case 0xB:
-        if (PROCESSOR_MODE == FIQ) return registers.r11_fiq;
-        return registers.r11;
+        if (PROCESSOR_MODE == FIQ) return gba->registers.r11_fiq;
+        return gba->registers.r11;
     case 0xC:
-        if (PROCESSOR_MODE == FIQ) return registers.r12_fiq;
-        return registers.r12;
+        if (PROCESSOR_MODE == FIQ) return gba->registers.r12_fiq;
+        return gba->registers.r12;
     case 0xD:
         switch (PROCESSOR_MODE) {
         case User:
-        case System: return registers.r13;
-        case FIQ: return registers.r13_fiq;
-        case IRQ: return registers.r13_irq;
-        case Supervisor: return registers.r13_svc;
-        case Abort: return registers.r13_abt;
-        case Undefined: return registers.r13_und;
+        case System: return gba->registers.r13;
+        case FIQ: return gba->registers.r13_fiq;
+        case IRQ: return gba->registers.r13_irq;
+        case Supervisor: return gba->registers.r13_svc;
+        case Abort: return gba->registers.r13_abt;
+        case Undefined: return gba->registers.r13_und;
         default:
             fprintf(stderr, "CPU Error: invalid\n");
-            exit(1);
+            gba_fatal();
         }
     case 0xE:
         switch (PROCESSOR_MODE) {
         case User:
-        case System: return registers.r14;
-        case FIQ: return registers.r14_fiq;
-        case IRQ: return registers.r14_irq;
-        case Supervisor: return registers.r14_svc;
-        case Abort: return registers.r14_abt;
-        case Undefined: return registers.r14_und;
+        case System: return gba->registers.r14;
+        case FIQ: return gba->registers.r14_fiq;
+        case IRQ: return gba->registers.r14_irq;
+        case Supervisor: return gba->registers.r14_svc;
+        case Abort: return gba->registers.r14_abt;
+        case Undefined: return gba->registers.r14_und;
         default:
             fprintf(stderr, "CPU Error: invalid\n");
-            exit(1);
+            gba_fatal();
         }
-    case 0xF: return registers.r15;
+    case 0xF: return gba->registers.r15;
     }
 }
 
 static void set_reg(uint8_t reg_id, Word val) {
     switch (reg_id) {
     case 0x0:
-        registers.r0 = val;
+        gba->registers.r0 = val;
         break;
     case 0x1:
-        registers.r1 = val;
+        gba->registers.r1 = val;
         break;
     case 0x2:
-        registers.r2 = val;
+        gba->registers.r2 = val;
         break;
     case 0x3:
-        registers.r3 = val;
+        gba->registers.r3 = val;
         break;
     case 0x4:
-        registers.r4 = val;
+        gba->registers.r4 = val;
         break;
     case 0x5:
-        registers.r5 = val;
+        gba->registers.r5 = val;
         break;
     case 0x6:
-        registers.r6 = val;
+        gba->registers.r6 = val;
         break;
     case 0x7:
-        registers.r7 = val;
+        gba->registers.r7 = val;
         break;
     case 0x8:
         if (PROCESSOR_MODE == FIQ) {
-            registers.r8_fiq = val;
+            gba->registers.r8_fiq = val;
         } else {
-            registers.r8 = val;
+            gba->registers.r8 = val;
         }
         break;
     case 0x9:
         if (PROCESSOR_MODE == FIQ) {
-            registers.r9_fiq = val;
+            gba->registers.r9_fiq = val;
         } else {
-            registers.r9 = val;
+            gba->registers.r9 = val;
         }
         break;
     case 0xA:
         if (PROCESSOR_MODE == FIQ) {
-            registers.r10_fiq = val;
+            gba->registers.r10_fiq = val;
         } else {
-            registers.r10 = val;
+            gba->registers.r10 = val;
         }
         break;
     case 0xB:
         if (PROCESSOR_MODE == FIQ) {
-            registers.r11_fiq = val;
+            gba->registers.r11_fiq = val;
         } else {
-            registers.r11 = val;
+            gba->registers.r11 = val;
         }
         break;
     case 0xC:
         if (PROCESSOR_MODE == FIQ) {
-            registers.r12_fiq = val;
+            gba->registers.r12_fiq = val;
         } else {
-            registers.r12 = val;
+            gba->registers.r12 = val;
         }
         break;
     case 0xD:
         switch (PROCESSOR_MODE) {
         case User:
         case System:
-            registers.r13 = val;
+            gba->registers.r13 = val;
             break;
         case FIQ:
-            registers.r13_fiq = val;
+            gba->registers.r13_fiq = val;
             break;
         case IRQ:
-            registers.r13_irq = val;
+            gba->registers.r13_irq = val;
             break;
         case Supervisor:
-            registers.r13_svc = val;
+            gba->registers.r13_svc = val;
             break;
         case Abort:
-            registers.r13_abt = val;
+            gba->registers.r13_abt = val;
             break;
         case Undefined:
-            registers.r13_und = val;
+            gba->registers.r13_und = val;
             break;
         default:
             fprintf(stderr, "CPU Error: invalid\n");
-            exit(1);
+            gba_fatal();
         }
         break;
     case 0xE:
         switch (PROCESSOR_MODE) {
         case User:
         case System:
-            registers.r14 = val;
+            gba->registers.r14 = val;
             break;
         case FIQ:
-            registers.r14_fiq = val;
+            gba->registers.r14_fiq = val;
             break;
         case IRQ:
-            registers.r14_irq = val;
+            gba->registers.r14_irq = val;
             break;
         case Supervisor:
-            registers.r14_svc = val;
+            gba->registers.r14_svc = val;
             break;
         case Abort:
-            registers.r14_abt = val;
+            gba->registers.r14_abt = val;
             break;
         case Undefined:
-            registers.r14_und = val;
+            gba->registers.r14_und = val;
             break;
         default:
             fprintf(stderr, "CPU Error: invalid\n");
-            exit(1);
+            gba_fatal();
         }
         break;
     case 0xF:
@@ -431,73 +386,95 @@ static Word fetch() {
     Word instr;
 
     if (THUMB_ACTIVATED) {
-        instr = read_halfword(registers.r15);
-        registers.r15 += HALFWORD_ACCESS;
+        instr = read_halfword(gba->registers.r15);
+        gba->registers.r15 += HALFWORD_ACCESS;
     } else {
-        instr = read_word(registers.r15);
-        registers.r15 += WORD_ACCESS;
+        instr = read_word(gba->registers.r15);
+        gba->registers.r15 += WORD_ACCESS;
     }
 
     return instr;
 }
 
-// NOTE: might benefit from a LUT here in the future 
-static InstrType decode(Word instr) {
-    curr_instr = instr;
-    pipeline = fetch();
+static InstrType translate_thumb(HalfWord instr, Word *arm_instr) {
+    *arm_instr = instr;
 
-    if (THUMB_ACTIVATED) {
-        switch ((instr >> 13) & 0x7) {
-        case 0x0:
-            if (((instr >> 11) & 0x3) == 0x3) 
-                return thumb_decompress_2(instr, &curr_instr);
-            return thumb_decompress_1(instr, &curr_instr);
-        case 0x1: return thumb_decompress_3(instr, &curr_instr);
+    switch ((instr >> 13) & 0x7) {
+    case 0x0:
+        if (((instr >> 11) & 0x3) == 0x3) 
+            return thumb_decompress_2(instr, arm_instr);
+        return thumb_decompress_1(instr, arm_instr);
+    case 0x1: return thumb_decompress_3(instr, arm_instr);
+    case 0x2:
+        switch ((instr >> 10) & 0x7) {
+        case 0x0: return thumb_decompress_4(instr, arm_instr);
+        case 0x1: return thumb_decompress_5(instr, arm_instr);
         case 0x2:
-            switch ((instr >> 10) & 0x7) {
-            case 0x0: return thumb_decompress_4(instr, &curr_instr);
-            case 0x1: return thumb_decompress_5(instr, &curr_instr);
-            case 0x2:
-            case 0x3: return THUMB_LOAD_PC_RELATIVE;
-            }
-            if ((instr >> 9) & 1)
-                return thumb_decompress_8(instr, &curr_instr);
-            return thumb_decompress_7(instr, &curr_instr);
-        case 0x3: return thumb_decompress_9(instr, &curr_instr);
-        case 0x4:
-            if ((instr >> 12) & 1)
-                return thumb_decompress_11(instr, &curr_instr);
-            return thumb_decompress_10(instr, &curr_instr);
-        case 0x5:
-            if (((instr >> 12) & 1) == 0) 
-                return THUMB_RELATIVE_ADDRESS;
-            if (((instr >> 9) & 0x3) == 0x2)
-                return thumb_decompress_14(instr, &curr_instr);
-            return thumb_decompress_13(instr, &curr_instr);
-        case 0x6:
-            switch ((instr >> 12) & 0x3) {
-            case 0x0:
-                return thumb_decompress_15(instr, &curr_instr);
-            case 0x1:
-                switch ((instr >> 8) & 0xFF) {
-                case 0b11011111: return thumb_decompress_17(instr, &curr_instr);
-                case 0b10111110:
-                    fprintf(stderr, "CPU Error [THUMB]: debugging not supported!\n");
-                    exit(1);
-                }
-                return thumb_decompress_16(instr, &curr_instr);
-            }
-            return THUMB_BAD_INSTR;
-        case 0x7:
-            switch ((instr >> 11) & 0x3) {
-            case 0x0: return thumb_decompress_18(instr, &curr_instr);
-            case 0x2: return THUMB_LONG_BRANCH_1;
-            case 0x3:
-            case 0x1: return THUMB_LONG_BRANCH_2;
+        case 0x3: return THUMB_LOAD_PC_RELATIVE;
+        }
+        if ((instr >> 9) & 1)
+            return thumb_decompress_8(instr, arm_instr);
+        return thumb_decompress_7(instr, arm_instr);
+    case 0x3: return thumb_decompress_9(instr, arm_instr);
+    case 0x4:
+        if ((instr >> 12) & 1)
+            return thumb_decompress_11(instr, arm_instr);
+        return thumb_decompress_10(instr, arm_instr);
+    case 0x5:
+        if (((instr >> 12) & 1) == 0) 
+            return THUMB_RELATIVE_ADDRESS;
+        if (((instr >> 9) & 0x3) == 0x2)
+            return thumb_decompress_14(instr, arm_instr);
+        return thumb_decompress_13(instr, arm_instr);
+    case 0x6:
+        switch ((instr >> 12) & 0x3) {
+        case 0x0:
+            return thumb_decompress_15(instr, arm_instr);
+        case 0x1:
+            switch ((instr >> 8) & 0xFF) {
+            case 0b11011111: return thumb_decompress_17(instr, arm_instr);
+            case 0b10111110: return THUMB_BREAKPOINT;
             }
-            return THUMB_BAD_INSTR;
+            return thumb_decompress_16(instr, arm_instr);
+        }
+        return THUMB_BAD_INSTR;
+    case 0x7:
+        switch ((instr >> 11) & 0x3) {
+        case 0x0: return thumb_decompress_18(instr, arm_instr);
+        case 0x2: return THUMB_LONG_BRANCH_1;
+        case 0x3:
+        case 0x1: return THUMB_LONG_BRANCH_2;
         }
         return THUMB_BAD_INSTR;
+    }
+    return THUMB_BAD_INSTR;
+}
+
+// a thumb instruction translates the same no matter where it is, so every opcode is translated once
+// into a table that is shared (read-only) by all instances, whether it runs from ROM or RAM
+typedef struct {
+    Word arm_instr;
+    InstrType type;
+} ThumbTranslation;
+
+static ThumbTranslation thumb_translations[0x10000];
+static pthread_once_t thumb_translations_once = PTHREAD_ONCE_INIT;
+
+static void build_thumb_translations(void) {
+    for (Word instr = 0; instr < 0x10000; instr++) {
+        ThumbTranslation *translation = &thumb_translations[instr];
+        translation->type = translate_thumb(instr, &translation->arm_instr);
+    }
+}
+
+static InstrType decode(Word instr) {
+    gba->curr_instr = instr;
+    gba->pipeline = fetch();
+
+    if (THUMB_ACTIVATED) {
+        const ThumbTranslation *translation = &thumb_translations[instr];
+        gba->curr_instr = translation->arm_instr;
+        return translation->type;
     } else {
         switch ((instr >> 25) & 0x7) {
         case 0x0:
@@ -525,12 +502,12 @@ static InstrType decode(Word instr) {
         case 0x5: return BRANCH;
         case 0x6:
             fprintf(stderr, "CPU Error [ARM]: coprocessor instructions not supported on GBA!\n");
-            exit(1);
+            gba_fatal();
         case 0x7:
             if ((instr >> 24) & 1) 
                 return SWI;
             fprintf(stderr, "CPU Error [ARM]: debugging not supported!\n", instr);
-            exit(1);
+            gba_fatal();
         default: return ARM_BAD_INSTR;
         }
     }
@@ -556,7 +533,7 @@ static InstrType decode(Word instr) {
 static Word barrel_shifter(ShiftType shift_type, Word operand_2, size_t shift, bool reg_shift_by_immediate) {
     // EDGE CASE: Rs=00h carry flag not affected
     if (!reg_shift_by_immediate && (shift == 0)) {
-        shifter_carry = CC_UNMOD;
+        gba->shifter_carry = CC_UNMOD;
         return operand_2;
     }
 
@@ -564,14 +541,14 @@ static Word barrel_shifter(ShiftType shift_type, Word operand_2, size_t shift, b
     case SHIFT_TYPE_LSL:
         switch (shift) {
         case 0: // LSL#0: No shift performed, ie. directly Op2=Rm, the C flag is NOT affected.
-            shifter_carry = CC_UNMOD;
+            gba->shifter_carry = CC_UNMOD;
             break;
         case 32: // LSL#32: LSL by 32 has result zero, carry out equal to bit 0 of Rm.
-            shifter_carry = operand_2 & 1;
+            gba->shifter_carry = operand_2 & 1;
             operand_2 = 0;
             break;
         default: // LSL by more than 32 has result zero, carry out zero.
-            shifter_carry = shift > 32 ? 0
+            gba->shifter_carry = shift > 32 ? 0
                 : (operand_2 << (shift - 1)) >> 31;
             operand_2 = shift > 32 ? 0
                 : operand_2 << shift;
@@ -581,16 +558,16 @@ static Word barrel_shifter(ShiftType shift_type, Word operand_2, size_t shift, b
         switch (shift) {
         case 0: // LSR#0 (shift by immediate): Interpreted as LSR#32, ie. Op2 becomes zero, C becomes Bit 31 of Rm.
             if (reg_shift_by_immediate) {
-                shifter_carry = operand_2 >> 31;
+                gba->shifter_carry = operand_2 >> 31;
                 operand_2 = 0;
             }
             break;
         case 32: // LSR#32: LSR by 32 has result zero, carry out equal to bit 31 of Rm.
-            shifter_carry = operand_2 >> 31;
+            gba->shifter_carry = operand_2 >> 31;
             operand_2 = 0;
             break;
         default: // LSR by more than 32 has result zero, carry out zero.
-            shifter_carry = shift > 32 ? 0 
+            gba->shifter_carry = shift > 32 ? 0 
                 : (operand_2 >> (shift - 1)) & 1;
             operand_2 = shift > 32 ? 0 
                 : operand_2 >> shift;
@@ -600,13 +577,13 @@ static Word barrel_shifter(ShiftType shift_type, Word operand_2, size_t shift, b
         // ASR#0 (shift by immediate): Interpreted as ASR#32, ie. Op2 and C are filled by Bit 31 of Rm.
         if (reg_shift_by_immediate && (shift == 0)) {
             Bit msb = operand_2 >> 31;
-            shifter_carry = msb;
+            gba->shifter_carry = msb;
             operand_2 = msb ? ~0 : 0;
             break;
         }
 
         // ASR by 32 or more has result filled with and carry out equal to bit 31 of Rm.
-        shifter_carry = shift > 31 ? operand_2 >> 31
+        gba->shifter_carry = shift > 31 ? operand_2 >> 31
             : ((int32_t)operand_2 >> (shift - 1)) & 1;
         operand_2 = shift > 31 ? (operand_2 >> 31 ? ~0 : 0)
             : (int32_t)operand_2 >> shift;
@@ -614,74 +591,74 @@ static Word barrel_shifter(ShiftType shift_type, Word operand_2, size_t shift, b
     case SHIFT_TYPE_ROR:
         // ROR#0 (shift by immediate): Interpreted as RRX#1 (RCR), like ROR#1, but Op2 Bit 31 set to old C.
         if (reg_shift_by_immediate && (shift == 0)) {
-            shifter_carry = operand_2 & 1;
+            gba->shifter_carry = operand_2 & 1;
             operand_2 = ((uint32_t)get_cc(C) << 31) | (operand_2 >> 1);
             break;
         }
 
         // ROR by n where n is greater than 32 will give the same result and carry out as ROR by n-32 repeated until shift in the range of 1-32
         operand_2 = (operand_2 >> (shift & 31)) | (operand_2 << ((-shift) & 31));
-        shifter_carry = operand_2 >> 31;
+        gba->shifter_carry = operand_2 >> 31;
         break;
     default:
         fprintf(stderr, "CPU Error: invalid shift opcode\n");
-        exit(1);
+        gba_fatal();
     }
 
     return operand_2;
 }
 
 static int arm_branch(void) {
-    Bit with_link = (curr_instr >> 24) & 1;
-    int32_t offset = (uint32_t)((int32_t)((curr_instr & 0xFFFFFF) << 8) >> 8) << 2; // sign extended 24-bit offset shifted left by 2
+    Bit with_link = (gba->curr_instr >> 24) & 1;
+    int32_t offset = (uint32_t)((int32_t)((gba->curr_instr & 0xFFFFFF) << 8) >> 8) << 2; // sign extended 24-bit offset shifted left by 2
 
     // adjust for step by 2 instead of 4 for translated THUMB immediates
     if (THUMB_ACTIVATED) 
         offset >>= 1;
 
     if (with_link) 
-        set_reg(LR_REG, registers.r15 - 4);
+        set_reg(LR_REG, gba->registers.r15 - 4);
 
-    registers.r15 = PC_UPDATE(registers.r15 + offset);
+    gba->registers.r15 = PC_UPDATE(gba->registers.r15 + offset);
 
-    DEBUG_PRINT(("B%s%s #0x%X\n", with_link ? "L" : "", cond_to_cstr(INSTR_COND_FIELD(curr_instr)), registers.r15))
+    DEBUG_PRINT(("B%s%s #0x%X\n", with_link ? "L" : "", cond_to_cstr(INSTR_COND_FIELD(gba->curr_instr)), gba->registers.r15))
     return 3;
 }
 
 static int arm_branch_exchange(void) {
-    uint8_t rn = curr_instr & 0xF;
+    uint8_t rn = gba->curr_instr & 0xF;
     Word rn_val = get_reg(rn);
 
-    switch ((curr_instr >> 4) & 0xF) {
+    switch ((gba->curr_instr >> 4) & 0xF) {
     case 0x1:
         if (rn_val & 1) {
-            registers.cpsr |= 0x20; // toggle THUMB
-            registers.r15 = PC_UPDATE(rn_val & ~0x1); // aligns to halfword boundary
+            gba->registers.cpsr |= 0x20; // toggle THUMB
+            gba->registers.r15 = PC_UPDATE(rn_val & ~0x1); // aligns to halfword boundary
         } else {
-            registers.cpsr &= ~(1 << 5); // toggle ARM
-            registers.r15 = PC_UPDATE(rn_val & ~0x3); // aligns to word boundary
+            gba->registers.cpsr &= ~(1 << 5); // toggle ARM
+            gba->registers.r15 = PC_UPDATE(rn_val & ~0x3); // aligns to word boundary
         }
 
-        DEBUG_PRINT(("BX%s %s\n", cond_to_cstr(INSTR_COND_FIELD(curr_instr)), register_to_cstr(rn)))
+        DEBUG_PRINT(("BX%s %s\n", cond_to_cstr(INSTR_COND_FIELD(gba->curr_instr)), register_to_cstr(rn)))
         break;
     case 0x3:
         DEBUG_PRINT(("BLX"))
-        exit(1);
+        gba_fatal();
         break;
     default:
         fprintf(stderr, "CPU Error: invalid BX opcode!\n");
-        exit(1);
+        gba_fatal();
     }
 
     return 3;
 }
 
 static int arm_alu(void) {
-    Bit i = (curr_instr >> 25) & 1;
-    Bit s = (curr_instr >> 20) & 1;
+    Bit i = (gba->curr_instr >> 25) & 1;
+    Bit s = (gba->curr_instr >> 20) & 1;
     
-    uint8_t rn = (curr_instr >> 16) & 0xF;
-    uint8_t rd = (curr_instr >> 12) & 0xF;
+    uint8_t rn = (gba->curr_instr >> 16) & 0xF;
+    uint8_t rd = (gba->curr_instr >> 12) & 0xF;
 
     Word operand_1 = get_reg(rn);
     Word operand_2;
@@ -691,40 +668,40 @@ static int arm_alu(void) {
     bool r15_transferred = rd == 0xF;
 
     if (i) {
-        uint8_t shift_amount = ((curr_instr & 0xF00) >> 8) * 2;
-        operand_2 = barrel_shifter(SHIFT_TYPE_ROR, curr_instr & 0xFF, shift_amount, false);
+        uint8_t shift_amount = ((gba->curr_instr & 0xF00) >> 8) * 2;
+        operand_2 = barrel_shifter(SHIFT_TYPE_ROR, gba->curr_instr & 0xFF, shift_amount, false);
     } else {
-        Bit r = (curr_instr >> 4) & 1;
-        uint8_t shift_type = (curr_instr >> 5) & 0x3;
-        uint8_t rm = curr_instr & 0xF;
+        Bit r = (gba->curr_instr >> 4) & 1;
+        uint8_t shift_type = (gba->curr_instr >> 5) & 0x3;
+        uint8_t rm = gba->curr_instr & 0xF;
         Word rm_val = get_reg(rm);
 
         if (r) {
             if (rn == 0xF) operand_1 = PC_VALUE;
             if (rm == 0xF) rm_val = PC_VALUE;
-            uint8_t shift_amount = get_reg((curr_instr >> 8) & 0xF) & 0xFF;
+            uint8_t shift_amount = get_reg((gba->curr_instr >> 8) & 0xF) & 0xFF;
             operand_2 = barrel_shifter(shift_type, rm_val, shift_amount, false);
             reg_shift = true;
         } else {
-            uint8_t shift_amount = (curr_instr >> 7) & 0x1F;
+            uint8_t shift_amount = (gba->curr_instr >> 7) & 0x1F;
             operand_2 = barrel_shifter(shift_type, rm_val, shift_amount, true);
         }
     }
 
-    switch ((curr_instr >> 21) & 0xF) {
+    switch ((gba->curr_instr >> 21) & 0xF) {
     case 0x0: {
-        DEBUG_PRINT(("AND%s%s %s, %s, #0x%X\n", cond_to_cstr(INSTR_COND_FIELD(curr_instr)), s ? "S" : "", register_to_cstr(rd), register_to_cstr(rn), operand_2))
+        DEBUG_PRINT(("AND%s%s %s, %s, #0x%X\n", cond_to_cstr(INSTR_COND_FIELD(gba->curr_instr)), s ? "S" : "", register_to_cstr(rd), register_to_cstr(rn), operand_2))
         Word result = operand_1 & operand_2;
         if (s)
-            set_cc(result >> 31, result == 0, shifter_carry, CC_UNMOD);
+            set_cc(result >> 31, result == 0, gba->shifter_carry, CC_UNMOD);
         set_reg(rd, result);
         break;
     }
     case 0x1: {
-        DEBUG_PRINT(("EOR%s%s %s, %s, #0x%X\n", cond_to_cstr(INSTR_COND_FIELD(curr_instr)), s ? "S" : "", register_to_cstr(rd), register_to_cstr(rn), operand_2))
+        DEBUG_PRINT(("EOR%s%s %s, %s, #0x%X\n", cond_to_cstr(INSTR_COND_FIELD(gba->curr_instr)), s ? "S" : "", register_to_cstr(rd), register_to_cstr(rn), operand_2))
         Word result = operand_1 ^ operand_2;
         if (s)
-            set_cc(result >> 31, result == 0, shifter_carry, CC_UNMOD);
+            set_cc(result >> 31, result == 0, gba->shifter_carry, CC_UNMOD);
         set_reg(rd, result);
         break;
     }
@@ -734,7 +711,7 @@ static int arm_alu(void) {
         operand_2 = temp;
     }
     case 0x2: {
-        DEBUG_PRINT(("SUB%s%s %s, %s, #0x%X\n", cond_to_cstr(INSTR_COND_FIELD(curr_instr)), s ? "S" : "", register_to_cstr(rd), register_to_cstr(rn), operand_2))
+        DEBUG_PRINT(("SUB%s%s %s, %s, #0x%X\n", cond_to_cstr(INSTR_COND_FIELD(gba->curr_instr)), s ? "S" : "", register_to_cstr(rd), register_to_cstr(rn), operand_2))
         Word result = operand_1 - operand_2;
         if (s)
             set_cc(result >> 31, result == 0, operand_1 >= operand_2, ((operand_1 >> 31) != (operand_2 >> 31)) && ((operand_1 >> 31) != (result >> 31)));
@@ -742,7 +719,7 @@ static int arm_alu(void) {
         break;
     }
     case 0x4: {
-        DEBUG_PRINT(("ADD%s%s %s, %s, #0x%X\n", cond_to_cstr(INSTR_COND_FIELD(curr_instr)), s ? "S" : "", register_to_cstr(rd), register_to_cstr(rn), operand_2))
+        DEBUG_PRINT(("ADD%s%s %s, %s, #0x%X\n", cond_to_cstr(INSTR_COND_FIELD(gba->curr_instr)), s ? "S" : "", register_to_cstr(rd), register_to_cstr(rn), operand_2))
         Word result = operand_1 + operand_2;
         if (s)
             set_cc(result >> 31, result == 0, ((operand_1 >> 31) + (operand_2 >> 31) > (result >> 31)), ((operand_1 >> 31) == (operand_2 >> 31)) && ((operand_1 >> 31) != (result >> 31)));
@@ -750,7 +727,7 @@ static int arm_alu(void) {
         break;
     }
     case 0x5: {
-        DEBUG_PRINT(("ADC%s%s %s, %s, #0x%X\n", cond_to_cstr(INSTR_COND_FIELD(curr_instr)), s ? "S" : "", register_to_cstr(rd), register_to_cstr(rn), operand_2))
+        DEBUG_PRINT(("ADC%s%s %s, %s, #0x%X\n", cond_to_cstr(INSTR_COND_FIELD(gba->curr_instr)), s ? "S" : "", register_to_cstr(rd), register_to_cstr(rn), operand_2))
         Word result = operand_1 + operand_2 + get_cc(C);
         if (s)
             set_cc(result >> 31, result == 0, ((operand_1 >> 31) + (operand_2 >> 31) > (result >> 31)), ((operand_1 >> 31) == (operand_2 >> 31)) && ((operand_1 >> 31) != (result >> 31)));
@@ -763,7 +740,7 @@ static int arm_alu(void) {
         operand_2 = temp;
     }
     case 0x6: {
-        DEBUG_PRINT(("SBC%s%s %s, %s, #0x%X\n", cond_to_cstr(INSTR_COND_FIELD(curr_instr)), s ? "S" : "", register_to_cstr(rd), register_to_cstr(rn), operand_2))
+        DEBUG_PRINT(("SBC%s%s %s, %s, #0x%X\n", cond_to_cstr(INSTR_COND_FIELD(gba->curr_instr)), s ? "S" : "", register_to_cstr(rd), register_to_cstr(rn), operand_2))
         Word result = operand_1 - operand_2 - !get_cc(C);
         if (s)
             set_cc(result >> 31, result == 0, (uint64_t)operand_1 >= ((uint64_t)operand_2 + !get_cc(C)), ((operand_1 >> 31) != (operand_2 >> 31)) && ((operand_1 >> 31) != (result >> 31)));
@@ -771,67 +748,67 @@ static int arm_alu(void) {
         break;
     }
     case 0x8: {
-        DEBUG_PRINT(("TST%s %s, #0x%X\n", cond_to_cstr(INSTR_COND_FIELD(curr_instr)), register_to_cstr(rn), operand_2))
+        DEBUG_PRINT(("TST%s %s, #0x%X\n", cond_to_cstr(INSTR_COND_FIELD(gba->curr_instr)), register_to_cstr(rn), operand_2))
         Word result = operand_1 & operand_2;
-        set_cc(result >> 31, result == 0, shifter_carry, CC_UNMOD);
+        set_cc(result >> 31, result == 0, gba->shifter_carry, CC_UNMOD);
         break;
     }
     case 0x9: {
-        DEBUG_PRINT(("TEQ%s %s, #0x%X\n", cond_to_cstr(INSTR_COND_FIELD(curr_instr)), register_to_cstr(rn), operand_2))
+        DEBUG_PRINT(("TEQ%s %s, #0x%X\n", cond_to_cstr(INSTR_COND_FIELD(gba->curr_instr)), register_to_cstr(rn), operand_2))
         Word result = operand_1 ^ operand_2;
-        set_cc(result >> 31, result == 0, shifter_carry, CC_UNMOD);
+        set_cc(result >> 31, result == 0, gba->shifter_carry, CC_UNMOD);
         break;
     }
     case 0xA: {
-        DEBUG_PRINT(("CMP%s %s, #0x%X\n", cond_to_cstr(INSTR_COND_FIELD(curr_instr)), register_to_cstr(rn), operand_2))
+        DEBUG_PRINT(("CMP%s %s, #0x%X\n", cond_to_cstr(INSTR_COND_FIELD(gba->curr_instr)), register_to_cstr(rn), operand_2))
         Word result = operand_1 - operand_2;
         set_cc(result >> 31, result == 0, operand_1 >= operand_2, ((operand_1 >> 31) != (operand_2 >> 31)) && ((operand_1 >> 31) != (result >> 31)));
         break;
     }
     case 0xB: {
-        DEBUG_PRINT(("CMN%s %s, #0x%X\n", cond_to_cstr(INSTR_COND_FIELD(curr_instr)), register_to_cstr(rn), operand_2))
+        DEBUG_PRINT(("CMN%s %s, #0x%X\n", cond_to_cstr(INSTR_COND_FIELD(gba->curr_instr)), register_to_cstr(rn), operand_2))
         Word result = operand_1 + operand_2;
         set_cc(result >> 31, result == 0, ((operand_1 >> 31) + (operand_2 >> 31) > (result >> 31)), ((operand_1 >> 31) == (operand_2 >> 31)) && ((operand_1 >> 31) != (result >> 31)));
         break;
     }
     case 0xC: {
-        DEBUG_PRINT(("ORR%s%s %s, %s, #0x%X\n", cond_to_cstr(INSTR_COND_FIELD(curr_instr)), s ? "S" : "", register_to_cstr(rd), register_to_cstr(rn), operand_2))
+        DEBUG_PRINT(("ORR%s%s %s, %s, #0x%X\n", cond_to_cstr(INSTR_COND_FIELD(gba->curr_instr)), s ? "S" : "", register_to_cstr(rd), register_to_cstr(rn), operand_2))
         Word result = operand_1 | operand_2;
         if (s)
-            set_cc(result >> 31, result == 0, shifter_carry, CC_UNMOD);
+            set_cc(result >> 31, result == 0, gba->shifter_carry, CC_UNMOD);
         set_reg(rd, result);
         break;
     }
     case 0xF: // MVN
         operand_2 = ~operand_2;
     case 0xD:
-        DEBUG_PRINT(("MOV%s%s %s, #0x%X\n", cond_to_cstr(INSTR_COND_FIELD(curr_instr)), s ? "S" : "", register_to_cstr(rd), operand_2))
+        DEBUG_PRINT(("MOV%s%s %s, #0x%X\n", cond_to_cstr(INSTR_COND_FIELD(gba->curr_instr)), s ? "S" : "", register_to_cstr(rd), operand_2))
         if (s)
-            set_cc(operand_2 >> 31, operand_2 == 0, shifter_carry, CC_UNMOD);
+            set_cc(operand_2 >> 31, operand_2 == 0, gba->shifter_carry, CC_UNMOD);
         set_reg(rd, operand_2);
         break;
     case 0xE: {
-        DEBUG_PRINT(("BIC%s%s %s, %s, #0x%X\n", cond_to_cstr(INSTR_COND_FIELD(curr_instr)), s ? "S" : "", register_to_cstr(rd), register_to_cstr(rn), operand_2))
+        DEBUG_PRINT(("BIC%s%s %s, %s, #0x%X\n", cond_to_cstr(INSTR_COND_FIELD(gba->curr_instr)), s ? "S" : "", register_to_cstr(rd), register_to_cstr(rn), operand_2))
         Word result = operand_1 & ~operand_2;
         if (s) 
-            set_cc(result >> 31, result == 0, shifter_carry, CC_UNMOD);
+            set_cc(result >> 31, result == 0, gba->shifter_carry, CC_UNMOD);
         set_reg(rd, result);
         break;
     }
     }
 
     if (s && r15_transferred)
-        registers.cpsr = get_psr_reg();
+        gba->registers.cpsr = get_psr_reg();
 
     return (1 + r15_transferred) + reg_shift + r15_transferred;
 }
 
 static int arm_multiply(void) {
-    Bit s = (curr_instr >> 20) & 1;
-    uint8_t rd = (curr_instr >> 16) & 0xF;
-    uint8_t rn = (curr_instr >> 12) & 0xF;
-    uint8_t rs = (curr_instr >> 8) & 0xF;
-    uint8_t rm = curr_instr & 0xF;
+    Bit s = (gba->curr_instr >> 20) & 1;
+    uint8_t rd = (gba->curr_instr >> 16) & 0xF;
+    uint8_t rn = (gba->curr_instr >> 12) & 0xF;
+    uint8_t rs = (gba->curr_instr >> 8) & 0xF;
+    uint8_t rm = gba->curr_instr & 0xF;
 
     Word rs_val = get_reg(rs);
 
@@ -841,27 +818,27 @@ static int arm_multiply(void) {
         : 4 - (((__builtin_clz(val_leading_zeros) + 0x7) & ~0x7) >> 3);
     if (m == 0) m = 4;
 
-    switch ((curr_instr >> 21) & 0xF) {
+    switch ((gba->curr_instr >> 21) & 0xF) {
     case 0x0: {
-        DEBUG_PRINT(("MUL%s%s %s, %s, %s\n", cond_to_cstr(INSTR_COND_FIELD(curr_instr)), s ? "S" : "", register_to_cstr(rd), register_to_cstr(rm), register_to_cstr(rs)))
+        DEBUG_PRINT(("MUL%s%s %s, %s, %s\n", cond_to_cstr(INSTR_COND_FIELD(gba->curr_instr)), s ? "S" : "", register_to_cstr(rd), register_to_cstr(rm), register_to_cstr(rs)))
         Word result = get_reg(rm) * get_reg(rs);
         if (s) set_cc(result >> 31, result == 0, CC_UNMOD, CC_UNMOD);
         set_reg(rd, result);
         return 1 + m;
     }
     case 0x1: {
-        DEBUG_PRINT(("MLA%s %s, %s, %s, %s\n", cond_to_cstr(INSTR_COND_FIELD(curr_instr)), register_to_cstr(rd), register_to_cstr(rm), register_to_cstr(rs), register_to_cstr(rn)))
+        DEBUG_PRINT(("MLA%s %s, %s, %s, %s\n", cond_to_cstr(INSTR_COND_FIELD(gba->curr_instr)), register_to_cstr(rd), register_to_cstr(rm), register_to_cstr(rs), register_to_cstr(rn)))
         Word result = get_reg(rm) * get_reg(rs) + get_reg(rn);
         if (s) set_cc(result >> 31, result == 0, CC_UNMOD, CC_UNMOD);
         set_reg(rd, result);
         return 2 + m;
     }
     case 0x2:
-        fprintf(stderr, "multiply opcode not implemented yet: %04X\n", (curr_instr >> 21) & 0xF);
-        exit(1);
+        fprintf(stderr, "multiply opcode not implemented yet: %04X\n", (gba->curr_instr >> 21) & 0xF);
+        gba_fatal();
         break;
     case 0x4: {
-        DEBUG_PRINT(("UMULL%s%s %s, %s, %s, %s\n", cond_to_cstr(INSTR_COND_FIELD(curr_instr)), s ? "S" : "", register_to_cstr(rn), register_to_cstr(rd), register_to_cstr(rm), register_to_cstr(rs)))
+        DEBUG_PRINT(("UMULL%s%s %s, %s, %s, %s\n", cond_to_cstr(INSTR_COND_FIELD(gba->curr_instr)), s ? "S" : "", register_to_cstr(rn), register_to_cstr(rd), register_to_cstr(rm), register_to_cstr(rs)))
         uint64_t result = (uint64_t)get_reg(rm) * (uint64_t)get_reg(rs);
         if (s) set_cc(result >> 63, result == 0, CC_UNMOD, CC_UNMOD);
         set_reg(rn, result & ~0);
@@ -869,14 +846,14 @@ static int arm_multiply(void) {
         return 2 + m;
     }
     case 0x5:
-        DEBUG_PRINT(("UMLAL%s%s %s, %s, %s, %s\n", cond_to_cstr(INSTR_COND_FIELD(curr_instr)), s ? "S" : "", register_to_cstr(rn), register_to_cstr(rd), register_to_cstr(rm), register_to_cstr(rs)))
+        DEBUG_PRINT(("UMLAL%s%s %s, %s, %s, %s\n", cond_to_cstr(INSTR_COND_FIELD(gba->curr_instr)), s ? "S" : "", register_to_cstr(rn), register_to_cstr(rd), register_to_cstr(rm), register_to_cstr(rs)))
         uint64_t result = (uint64_t)get_reg(rm) * (uint64_t)get_reg(rs) + (((uint64_t)get_reg(rd) << (uint64_t)32) | (uint64_t)get_reg(rn));
         if (s) set_cc(result >> 63, result == 0, CC_UNMOD, CC_UNMOD);
         set_reg(rn, result & ~0);
         set_reg(rd, (result >> 32) & ~0);
         return 3 + m;
     case 0x6: {
-        DEBUG_PRINT(("SMULL%s%s %s, %s, %s, %s\n", cond_to_cstr(INSTR_COND_FIELD(curr_instr)), s ? "S" : "", register_to_cstr(rn), register_to_cstr(rd), register_to_cstr(rm), register_to_cstr(rs)))
+        DEBUG_PRINT(("SMULL%s%s %s, %s, %s, %s\n", cond_to_cstr(INSTR_COND_FIELD(gba->curr_instr)), s ? "S" : "", register_to_cstr(rn), register_to_cstr(rd), register_to_cstr(rm), register_to_cstr(rs)))
         int64_t result = (int64_t)(int32_t)get_reg(rm) * (int64_t)(int32_t)get_reg(rs);
         if (s) set_cc(result >> 63, result == 0, CC_UNMOD, CC_UNMOD);
         set_reg(rn, result & ~0);
@@ -884,7 +861,7 @@ static int arm_multiply(void) {
         return 2 + m;
     }
     case 0x7: {
-        DEBUG_PRINT(("SMLAL%s%s %s, %s, %s, %s\n", cond_to_cstr(INSTR_COND_FIELD(curr_instr)), s ? "S" : "", register_to_cstr(rn), register_to_cstr(rd), register_to_cstr(rm), register_to_cstr(rs)))
+        DEBUG_PRINT(("SMLAL%s%s %s, %s, %s, %s\n", cond_to_cstr(INSTR_COND_FIELD(gba->curr_instr)), s ? "S" : "", register_to_cstr(rn), register_to_cstr(rd), register_to_cstr(rm), register_to_cstr(rs)))
         int64_t result = (int64_t)(int32_t)get_reg(rm) * (int64_t)(int32_t)get_reg(rs) + ((int64_t)((uint64_t)get_reg(rd) << (uint64_t)32) | (int64_t)get_reg(rn));
         if (s) set_cc(result >> 63, result == 0, CC_UNMOD, CC_UNMOD);
         set_reg(rn, result & ~0);
@@ -893,22 +870,22 @@ static int arm_multiply(void) {
     }
     default:
         fprintf(stderr, "CPU Error: invalid opcode\n");
-        exit(1);
+        gba_fatal();
     }
 }
 
 // FRAGILE!!
 static int arm_block_data_transfer(void) {
-    Bit p = (curr_instr >> 24) & 1;
-    Bit u = (curr_instr >> 23) & 1;
-    Bit s = (curr_instr >> 22) & 1; // if set, instruction is assumed to be executing in privileged mode
-    Bit w = (curr_instr >> 21) & 1;
-    Bit l = (curr_instr >> 20) & 1;
+    Bit p = (gba->curr_instr >> 24) & 1;
+    Bit u = (gba->curr_instr >> 23) & 1;
+    Bit s = (gba->curr_instr >> 22) & 1; // if set, instruction is assumed to be executing in privileged mode
+    Bit w = (gba->curr_instr >> 21) & 1;
+    Bit l = (gba->curr_instr >> 20) & 1;
 
-    uint8_t rn = (curr_instr >> 16) & 0xF;
-    uint16_t reg_list = curr_instr & 0xFFFF;
+    uint8_t rn = (gba->curr_instr >> 16) & 0xF;
+    uint16_t reg_list = gba->curr_instr & 0xFFFF;
 
-    DEBUG_PRINT(("%s%s%s %s, { ", l ? "LDM" : "STM", amod_to_cstr(p, u), cond_to_cstr(INSTR_COND_FIELD(curr_instr)), register_to_cstr(rn)))
+    DEBUG_PRINT(("%s%s%s %s, { ", l ? "LDM" : "STM", amod_to_cstr(p, u), cond_to_cstr(INSTR_COND_FIELD(gba->curr_instr)), register_to_cstr(rn)))
 
     // in the case of a user bank transfer this will store the old cpsr value
     // and will switch modes for this instruction alone (the effect should technically last for the following cpu instruction/cycle?? not sure)
@@ -917,10 +894,10 @@ static int arm_block_data_transfer(void) {
 
     if (s) {
         if (l && r15_transferred) {
-            registers.cpsr = get_psr_reg();
+            gba->registers.cpsr = get_psr_reg();
         } else {
-            user_bank_transfer = registers.cpsr;
-            registers.cpsr = (registers.cpsr & ~0xFF) | User;
+            user_bank_transfer = gba->registers.cpsr;
+            gba->registers.cpsr = (gba->registers.cpsr & ~0xFF) | User;
         }
     }
 
@@ -988,7 +965,7 @@ static int arm_block_data_transfer(void) {
     DEBUG_PRINT(("}\n"))
 
     if (user_bank_transfer) 
-        registers.cpsr = user_bank_transfer;
+        gba->registers.cpsr = user_bank_transfer;
 
     if (l)
         return (total_transfers + r15_transferred) + (1 + r15_transferred) + 1;
@@ -996,18 +973,18 @@ static int arm_block_data_transfer(void) {
 }
 
 static int arm_halfword_data_transfer(void) {
-    Bit p = (curr_instr >> 24) & 1;
-    Bit u = (curr_instr >> 23) & 1;
-    Bit i = (curr_instr >> 22) & 1;
-    Bit w = (curr_instr >> 21) & 1;
-    Bit l = (curr_instr >> 20) & 1;
+    Bit p = (gba->curr_instr >> 24) & 1;
+    Bit u = (gba->curr_instr >> 23) & 1;
+    Bit i = (gba->curr_instr >> 22) & 1;
+    Bit w = (gba->curr_instr >> 21) & 1;
+    Bit l = (gba->curr_instr >> 20) & 1;
 
-    uint8_t rn = (curr_instr >> 16) & 0xF;
-    uint8_t rd = (curr_instr >> 12) & 0xF;
+    uint8_t rn = (gba->curr_instr >> 16) & 0xF;
+    uint8_t rd = (gba->curr_instr >> 12) & 0xF;
 
     int32_t offset = i ?
-        ((((curr_instr >> 8) & 0xF) << 4) | (curr_instr & 0xF)) : 
-            get_reg(curr_instr & 0xF);
+        ((((gba->curr_instr >> 8) & 0xF) << 4) | (gba->curr_instr & 0xF)) : 
+            get_reg(gba->curr_instr & 0xF);
     if (!u) offset = -offset;
 
     Word addr = get_reg(rn) + (p ? offset : 0);
@@ -1017,9 +994,9 @@ static int arm_halfword_data_transfer(void) {
         // https://problemkaputt.de/gbatek.htm#armcpumemoryalignments
         // LDRH and LDRSH have unique handling for misaligned accesses
 
-        switch ((curr_instr >> 5) & 0x3) {
+        switch ((gba->curr_instr >> 5) & 0x3) {
         case 0x1: {
-            DEBUG_PRINT(("LDR%sH ", cond_to_cstr(INSTR_COND_FIELD(curr_instr))))
+            DEBUG_PRINT(("LDR%sH ", cond_to_cstr(INSTR_COND_FIELD(gba->curr_instr))))
             bool is_misaligned = addr & 1;
             Word read_value = is_misaligned ? ROR((uint32_t)read_halfword(addr - 1), 8) 
                 : read_halfword(addr);
@@ -1027,11 +1004,11 @@ static int arm_halfword_data_transfer(void) {
             break;
         }
         case 0x2:
-            DEBUG_PRINT(("LDR%sSB ", cond_to_cstr(INSTR_COND_FIELD(curr_instr))))
+            DEBUG_PRINT(("LDR%sSB ", cond_to_cstr(INSTR_COND_FIELD(gba->curr_instr))))
             set_reg(rd, (int32_t)(int8_t)read_byte(addr));
             break;
         case 0x3: {
-            DEBUG_PRINT(("LDR%sSH ", cond_to_cstr(INSTR_COND_FIELD(curr_instr))))
+            DEBUG_PRINT(("LDR%sSH ", cond_to_cstr(INSTR_COND_FIELD(gba->curr_instr))))
             bool is_misaligned = addr & 1;
             Word read_value = is_misaligned ? (int32_t)(int8_t)read_byte(addr)
                 : (int32_t)(int16_t)read_halfword(addr);
@@ -1040,20 +1017,20 @@ static int arm_halfword_data_transfer(void) {
         }
         }
     } else {
-        switch ((curr_instr >> 5) & 0x3) {
+        switch ((gba->curr_instr >> 5) & 0x3) {
         case 0x1:
-            DEBUG_PRINT(("STR%sH ", cond_to_cstr(INSTR_COND_FIELD(curr_instr))))
+            DEBUG_PRINT(("STR%sH ", cond_to_cstr(INSTR_COND_FIELD(gba->curr_instr))))
             write_halfword(addr, get_reg(rd));
             break;
         case 0x2:
-            DEBUG_PRINT(("LDR%sD ", cond_to_cstr(INSTR_COND_FIELD(curr_instr))))
+            DEBUG_PRINT(("LDR%sD ", cond_to_cstr(INSTR_COND_FIELD(gba->curr_instr))))
             printf("IMPL LDRD");
-            exit(1);
+            gba_fatal();
             break;
         case 0x3:
-            DEBUG_PRINT(("STR%sD ", cond_to_cstr(INSTR_COND_FIELD(curr_instr))))
+            DEBUG_PRINT(("STR%sD ", cond_to_cstr(INSTR_COND_FIELD(gba->curr_instr))))
             printf("IMPL STRD");
-            exit(1);
+            gba_fatal();
             break;
         }
     }
@@ -1073,7 +1050,7 @@ static int arm_halfword_data_transfer(void) {
                 DEBUG_PRINT(("]"))
             }
         } else {
-            DEBUG_PRINT((", %s]", register_to_cstr(curr_instr & 0xF)))
+            DEBUG_PRINT((", %s]", register_to_cstr(gba->curr_instr & 0xF)))
         }
         DEBUG_PRINT(("%s", should_write_back ? "!" : ""))
     } else {
@@ -1081,7 +1058,7 @@ static int arm_halfword_data_transfer(void) {
         if (i) {
             DEBUG_PRINT(("#0x%X", !u ? -offset : offset))
         } else {
-            DEBUG_PRINT(("%s", register_to_cstr(curr_instr & 0xF)))
+            DEBUG_PRINT(("%s", register_to_cstr(gba->curr_instr & 0xF)))
         }
     }
     DEBUG_PRINT(("\n"))
@@ -1094,44 +1071,44 @@ static int arm_halfword_data_transfer(void) {
 }
 
 static int arm_single_data_transfer(void) {
-    Bit i = (curr_instr >> 25) & 1;
-    Bit p = (curr_instr >> 24) & 1;
-    Bit u = (curr_instr >> 23) & 1;
-    Bit b = (curr_instr >> 22) & 1;
-    Bit t = (curr_instr >> 21) & 1;
-    Bit l = (curr_instr >> 20) & 1;
-
-    uint8_t rn = (curr_instr >> 16) & 0xF;
-    uint8_t rd = (curr_instr >> 12) & 0xF;
-    uint8_t rm = curr_instr & 0xF;
-
-    uint8_t shift_amount = (curr_instr >> 7) & 0x1F;
-    Word offset = i ? barrel_shifter((curr_instr >> 5) & 0x3, get_reg(curr_instr & 0xF), shift_amount, true) 
-        : curr_instr & 0xFFF;
+    Bit i = (gba->curr_instr >> 25) & 1;
+    Bit p = (gba->curr_instr >> 24) & 1;
+    Bit u = (gba->curr_instr >> 23) & 1;
+    Bit b = (gba->curr_instr >> 22) & 1;
+    Bit t = (gba->curr_instr >> 21) & 1;
+    Bit l = (gba->curr_instr >> 20) & 1;
+
+    uint8_t rn = (gba->curr_instr >> 16) & 0xF;
+    uint8_t rd = (gba->curr_instr >> 12) & 0xF;
+    uint8_t rm = gba->curr_instr & 0xF;
+
+    uint8_t shift_amount = (gba->curr_instr >> 7) & 0x1F;
+    Word offset = i ? barrel_shifter((gba->curr_instr >> 5) & 0x3, get_reg(gba->curr_instr & 0xF), shift_amount, true) 
+        : gba->curr_instr & 0xFFF;
     if (!u) offset = -offset;
 
     Word addr = get_reg(rn) + (p ? offset : 0);
     bool should_write_back = !p || (p && t);
 
-    if (p && b && l && !t && (rd == 0xF) && (((curr_instr >> 28) & 0xF) == 0xF)) {
+    if (p && b && l && !t && (rd == 0xF) && (((gba->curr_instr >> 28) & 0xF) == 0xF)) {
         printf("PLD INSTRUCTION!\n");
-        exit(1);
+        gba_fatal();
     }
 
     if (!p && t) {
         printf("memory manage bit is set\n");
-        exit(1);
+        gba_fatal();
     }
 
     if (l) {
         // https://problemkaputt.de/gbatek.htm#armcpumemoryalignments
         // LDR has unique handling for misaligned accesses
-        DEBUG_PRINT(("LDR%s%s%s ", cond_to_cstr(INSTR_COND_FIELD(curr_instr)), b ? "B" : "", t && !p ? "T" : ""))
+        DEBUG_PRINT(("LDR%s%s%s ", cond_to_cstr(INSTR_COND_FIELD(gba->curr_instr)), b ? "B" : "", t && !p ? "T" : ""))
         Word read_value = b ? read_byte(addr)
             : ROR(read_word(addr), ROT_READ_SHIFT_AMOUNT(addr));
         set_reg(rd, read_value);
     } else {
-        DEBUG_PRINT(("STR%s%s%s ", cond_to_cstr(INSTR_COND_FIELD(curr_instr)), b ? "B" : "", t && !p ? "T" : ""))
+        DEBUG_PRINT(("STR%s%s%s ", cond_to_cstr(INSTR_COND_FIELD(gba->curr_instr)), b ? "B" : "", t && !p ? "T" : ""))
         // THUMB will not decompress to an instruction that will specify a rd of 15
         // so only the PC + 12 case has to be handled here
         Word stored_value = get_reg(rd) + ((rd == 0xF) << 2);
@@ -1157,7 +1134,7 @@ static int arm_single_data_transfer(void) {
                 DEBUG_PRINT(("]"))
             }
         } else {
-            DEBUG_PRINT((", %s]", register_to_cstr(curr_instr & 0xF)))
+            DEBUG_PRINT((", %s]", register_to_cstr(gba->curr_instr & 0xF)))
         }
         DEBUG_PRINT(("%s", should_write_back ? "!" : ""))
     } else {
@@ -1165,7 +1142,7 @@ static int arm_single_data_transfer(void) {
         if (i) {
             DEBUG_PRINT(("#0x%X", !u ? -offset : offset))
         } else {
-            DEBUG_PRINT(("%s", register_to_cstr(curr_instr & 0xF)))
+            DEBUG_PRINT(("%s", register_to_cstr(gba->curr_instr & 0xF)))
         }
     }
     DEBUG_PRINT(("\n"))
@@ -1178,10 +1155,10 @@ static int arm_single_data_transfer(void) {
 }
 
 static int arm_single_data_swap(void) {
-    Bit b = (curr_instr >> 22) & 1;
-    uint8_t rn = (curr_instr >> 16) & 0xF;
-    uint8_t rd = (curr_instr >> 12) & 0xF;
-    uint8_t rm = curr_instr & 0xF;
+    Bit b = (gba->curr_instr >> 22) & 1;
+    uint8_t rn = (gba->curr_instr >> 16) & 0xF;
+    uint8_t rd = (gba->curr_instr >> 12) & 0xF;
+    uint8_t rm = gba->curr_instr & 0xF;
     Word addr = get_reg(rn);
 
     if (b) {
@@ -1194,20 +1171,20 @@ static int arm_single_data_swap(void) {
         set_reg(rd, temp_val);
     }
 
-    DEBUG_PRINT(("SWP%s%s %s, %s, [%s]\n", cond_to_cstr(INSTR_COND_FIELD(curr_instr)), b ? "B" : "", register_to_cstr(rd), register_to_cstr(rm), register_to_cstr(rn)))
+    DEBUG_PRINT(("SWP%s%s %s, %s, [%s]\n", cond_to_cstr(INSTR_COND_FIELD(gba->curr_instr)), b ? "B" : "", register_to_cstr(rd), register_to_cstr(rm), register_to_cstr(rn)))
     return 4;
 }
 
 static int arm_msr(void) {
-    DEBUG_PRINT(("MSR%s ", cond_to_cstr(INSTR_COND_FIELD(curr_instr))))
+    DEBUG_PRINT(("MSR%s ", cond_to_cstr(INSTR_COND_FIELD(gba->curr_instr))))
 
-    Bit i = (curr_instr >> 25) & 1;
-    Bit psr = (curr_instr >> 22) & 1;
-    Bit f = (curr_instr >> 19) & 1; // if set, modify psr cc flag bits
-    Bit c = (curr_instr >> 16) & 1; // if set, modify psr control (processor mode) bits
+    Bit i = (gba->curr_instr >> 25) & 1;
+    Bit psr = (gba->curr_instr >> 22) & 1;
+    Bit f = (gba->curr_instr >> 19) & 1; // if set, modify psr cc flag bits
+    Bit c = (gba->curr_instr >> 16) & 1; // if set, modify psr control (processor mode) bits
 
-    Word operand = i ? ROR(curr_instr & 0xFF, ((curr_instr >> 8) & 0xF) * 2)
-        : get_reg(curr_instr & 0xF);
+    Word operand = i ? ROR(gba->curr_instr & 0xFF, ((gba->curr_instr >> 8) & 0xF) * 2)
+        : get_reg(gba->curr_instr & 0xF);
 
     // bits 8-23 of cpsr are reserved and cannot be modified.
     if (psr) {
@@ -1216,38 +1193,38 @@ static int arm_msr(void) {
         if (c) set_psr_reg((get_psr_reg() & 0xFFFFFF00) | (operand & 0x000000FF));
     } else {
         DEBUG_PRINT(("cpsr, "))
-        if (f) registers.cpsr = (registers.cpsr & 0x00FFFFFF) | (operand & 0xFF000000);
-        if (c) registers.cpsr = (registers.cpsr & 0xFFFFFF00) | (operand & 0x000000FF);
+        if (f) gba->registers.cpsr = (gba->registers.cpsr & 0x00FFFFFF) | (operand & 0xFF000000);
+        if (c) gba->registers.cpsr = (gba->registers.cpsr & 0xFFFFFF00) | (operand & 0x000000FF);
     }
 
-    if (i) { DEBUG_PRINT(("#0x%X\n", operand)) } else { DEBUG_PRINT(("%s\n", register_to_cstr(curr_instr & 0xF))) }
+    if (i) { DEBUG_PRINT(("#0x%X\n", operand)) } else { DEBUG_PRINT(("%s\n", register_to_cstr(gba->curr_instr & 0xF))) }
 
     return 1;
 }
 
 static int arm_mrs(void) {
-    DEBUG_PRINT(("MRS%s ", cond_to_cstr(INSTR_COND_FIELD(curr_instr))))
+    DEBUG_PRINT(("MRS%s ", cond_to_cstr(INSTR_COND_FIELD(gba->curr_instr))))
 
-    Bit psr = (curr_instr >> 22) & 1;
-    uint8_t rd = (curr_instr >> 12) & 0xF;
+    Bit psr = (gba->curr_instr >> 22) & 1;
+    uint8_t rd = (gba->curr_instr >> 12) & 0xF;
 
     if (psr) {
         DEBUG_PRINT(("%s, spsr_%s\n", register_to_cstr(rd), processor_mode_to_cstr(PROCESSOR_MODE)))
         set_reg(rd, get_psr_reg());
     } else {
         DEBUG_PRINT(("%s, cpsr\n", register_to_cstr(rd)))
-        set_reg(rd, registers.cpsr);
+        set_reg(rd, gba->registers.cpsr);
     }
 
     return 1;
 }
 
 static int arm_software_interrupt(void) {
-    DEBUG_PRINT(("SWI%s #%X\n", cond_to_cstr(INSTR_COND_FIELD(curr_instr)), curr_instr & 0xFFFFFF))
-    registers.r14_svc = registers.r15 - 4; // LR set to the instruction following SWI (PC + 4) (note: r15 always PC + 8)
-    registers.spsr_svc = registers.cpsr;
+    DEBUG_PRINT(("SWI%s #%X\n", cond_to_cstr(INSTR_COND_FIELD(gba->curr_instr)), gba->curr_instr & 0xFFFFFF))
+    gba->registers.r14_svc = gba->registers.r15 - 4; // LR set to the instruction following SWI (PC + 4) (note: r15 always PC + 8)
+    gba->registers.spsr_svc = gba->registers.cpsr;
     SET_PROCESSOR_MODE(Supervisor)
-    registers.r15 = PC_UPDATE(0x00000008);
+    gba->registers.r15 = PC_UPDATE(0x00000008);
     return 3;
 }
 
@@ -1255,20 +1232,20 @@ static int arm_software_interrupt(void) {
 static int thumb_handler(InstrType type) {
     switch (type) {
     case THUMB_LOAD_PC_RELATIVE: { // format 6
-        uint8_t rd = (curr_instr >> 8) & 0x7;
-        uint16_t nn = (curr_instr & 0xFF) << 2; // 10-bit unsigned immediate offset
+        uint8_t rd = (gba->curr_instr >> 8) & 0x7;
+        uint16_t nn = (gba->curr_instr & 0xFF) << 2; // 10-bit unsigned immediate offset
         DEBUG_PRINT(("LDR %s, [pc, #0x%X]\n", register_to_cstr(rd), nn))
-        set_reg(rd, read_word((registers.r15 & ~0x2) + nn));
+        set_reg(rd, read_word((gba->registers.r15 & ~0x2) + nn));
         return 3;
     }
     case THUMB_RELATIVE_ADDRESS: { // format 12
-        uint8_t rd = (curr_instr >> 8) & 0x7;
-        uint16_t nn = (curr_instr & 0xFF) << 2; // 10-bit unsigned immediate offset
+        uint8_t rd = (gba->curr_instr >> 8) & 0x7;
+        uint16_t nn = (gba->curr_instr & 0xFF) << 2; // 10-bit unsigned immediate offset
 
-        switch ((curr_instr >> 11) & 1) {
+        switch ((gba->curr_instr >> 11) & 1) {
         case 0:
             DEBUG_PRINT(("ADD %s, pc, #0x%X\n", register_to_cstr(rd), nn))
-            set_reg(rd, (registers.r15 & ~0x2) + nn);
+            set_reg(rd, (gba->registers.r15 & ~0x2) + nn);
             break;
         case 1:
             DEBUG_PRINT(("ADD %s, sp, #0x%X\n", register_to_cstr(rd), nn))
@@ -1278,39 +1255,39 @@ static int thumb_handler(InstrType type) {
         return 1;
     }
     case THUMB_LONG_BRANCH_1: { // format 19 (H = 0)
-        Word upper_half_offset = (int32_t)((curr_instr & 0x7FF) << 21) >> 21;
-        set_reg(LR_REG, registers.r15 + (upper_half_offset << 12));
-        DEBUG_PRINT(("MOV lr, #0x%08X [BL 1]\n", registers.r15 + (upper_half_offset << 12)));
+        Word upper_half_offset = (int32_t)((gba->curr_instr & 0x7FF) << 21) >> 21;
+        set_reg(LR_REG, gba->registers.r15 + (upper_half_offset << 12));
+        DEBUG_PRINT(("MOV lr, #0x%08X [BL 1]\n", gba->registers.r15 + (upper_half_offset << 12)));
         return 1;
     }
     case THUMB_LONG_BRANCH_2: { // format 19 (H = 1)
-        Word lower_half_offset = curr_instr & 0x7FF;
-        Word curr_pc = registers.r15;
+        Word lower_half_offset = gba->curr_instr & 0x7FF;
+        Word curr_pc = gba->registers.r15;
 
-        switch ((curr_instr >> 11) & 0x1F) {
+        switch ((gba->curr_instr >> 11) & 0x1F) {
         case 0b11111:
-            registers.r15 = PC_UPDATE(get_reg(LR_REG) + (lower_half_offset << 1));
+            gba->registers.r15 = PC_UPDATE(get_reg(LR_REG) + (lower_half_offset << 1));
             break;
         case 0b11101:
             printf("BLX THUMB\n");
-            exit(1);
+            gba_fatal();
         default:
             fprintf(stderr, "CPU Error [THUMB]: invalid long branch opcode!\n");
-            exit(1);
+            gba_fatal();
         }
         set_reg(LR_REG, (curr_pc - 2) | 1);
 
-        DEBUG_PRINT(("MOV pc, #0x%08X | lr, #0x%08X [BL 2]\n", registers.r15, get_reg(LR_REG)))
+        DEBUG_PRINT(("MOV pc, #0x%08X | lr, #0x%08X [BL 2]\n", gba->registers.r15, get_reg(LR_REG)))
         return 3;
     }
     default:
         fprintf(stderr, "unhandled thumb instruction type\n");
-        exit(1);
+        gba_fatal();
     }
 }
 
 static int arm_handler(InstrType type) {
-    if (!eval_cond(INSTR_COND_FIELD(curr_instr))) {
+    if (!eval_cond(INSTR_COND_FIELD(gba->curr_instr))) {
         DEBUG_PRINT(("\n"));
         return 1;
     }
@@ -1328,11 +1305,14 @@ static int arm_handler(InstrType type) {
     case MSR: return arm_msr();
     case MRS: return arm_mrs();
     case SWP: return arm_single_data_swap();
+    default:
+        fprintf(stderr, "unhandled arm instruction type\n");
+        gba_fatal();
     }
 }
 
 static int execute(void) {
-    Word instr = pipeline ? pipeline : fetch();
+    Word instr = gba->pipeline ? gba->pipeline : fetch();
     InstrType type = decode(instr);
 
     int cycles_consumed = 0;
@@ -1340,19 +1320,22 @@ static int execute(void) {
     switch (type) {
     case ARM_BAD_INSTR:
         fprintf(stderr, "[ARM] invalid opcode: #0x%08X\n", instr);
-        exit(1);
+        gba_fatal();
     case THUMB_BAD_INSTR:
         fprintf(stderr, "[THUMB] invalid opcode: #0x%04X\n", instr);
-        exit(1);
+        gba_fatal();
+    case THUMB_BREAKPOINT:
+        fprintf(stderr, "CPU Error [THUMB]: debugging not supported!\n");
+        gba_fatal();
     case THUMB_LOAD_PC_RELATIVE:
     case THUMB_RELATIVE_ADDRESS:
     case THUMB_LONG_BRANCH_1:
     case THUMB_LONG_BRANCH_2:
-        DEBUG_PRINT(("[THUMB] (%08X) %08X ", registers.r15 - 4, curr_instr))
+        DEBUG_PRINT(("[THUMB] (%08X) %08X ", gba->registers.r15 - 4, gba->curr_instr))
         cycles_consumed = thumb_handler(type);
         break;
     default:
-        DEBUG_PRINT(("[%s] (%08X) %08X ", THUMB_ACTIVATED ? "THUMB" : "ARM", registers.r15 - (THUMB_ACTIVATED ? 4 : 8), curr_instr))
+        DEBUG_PRINT(("[%s] (%08X) %08X ", THUMB_ACTIVATED ? "THUMB" : "ARM", gba->registers.r15 - (THUMB_ACTIVATED ? 4 : 8), gba->curr_instr))
         cycles_consumed = arm_handler(type);
     }
 
@@ -1360,22 +1343,81 @@ static int execute(void) {
 }
 
 void init_GBA(const char *rom_file, const char *bios_file) {
+    pthread_once(&thumb_translations_once, build_thumb_translations);
+
     load_bios(bios_file);
     load_rom(rom_file);
+    reset_cpu();
+}
 
+// on top of the machine state being all zeroes
+void reset_cpu(void) {
     // initialize stack
-    registers.r13_svc = 0x03007FE0;
-    registers.r13_irq = 0x03007FA0;
-    registers.r13 = 0x03007F00;
+    gba->registers.r13_svc = 0x03007FE0;
+    gba->registers.r13_irq = 0x03007FA0;
+    gba->registers.r13 = 0x03007F00;
 
     // initialize PC + default mode
-    registers.r14 = 0x08000000;
-    registers.r15 = 0x08000000;
-    registers.cpsr |= System;
+    gba->registers.r14 = 0x08000000;
+    gba->registers.r15 = 0x08000000;
+    gba->registers.cpsr |= System;
+}
+
+void enable_profiling(bool enable) {
+    gba->profiling_enabled = enable;
+}
+
+// the same as the loop in compute_frame(), but timed each time the CPU switches between ARM and THUMB
+// (rarely, compared to how many instructions run) so that the clock isn't read per instruction. the
+// time the PPU spent drawing meanwhile is taken out of it
+static void run_profiled_frame(void) {
+    FrameProfile *profile = &gba->profile;
+    *profile = (FrameProfile){0};
+
+    bool thumb = THUMB_ACTIVATED;
+    double start = gba_now_seconds();
+    double ppu_start = 0;
+
+    int total_cycles = 0;
+    for (;;) {
+        bool done = total_cycles >= CYCLES_PER_FRAME;
+        if (done || (THUMB_ACTIVATED != thumb)) {
+            double now = gba_now_seconds();
+            double seconds = (now - start) - (profile->ppu_draw_seconds - ppu_start);
+            if (thumb)
+                profile->thumb_seconds += seconds;
+            else
+                profile->arm_seconds += seconds;
+
+            thumb = THUMB_ACTIVATED;
+            start = now;
+            ppu_start = profile->ppu_draw_seconds;
+        }
+        if (done)
+            break;
+
+        if (thumb)
+            profile->thumb_instructions++;
+        else
+            profile->arm_instructions++;
+
+        int cycles_passed = execute();
+        for (int j = 0; j < cycles_passed; j++) {
+            tick_ppu();
+        }
+        total_cycles += cycles_passed;
+    }
+
+    flush_ppu();
 }
 
 uint16_t* compute_frame(uint16_t input) {
-    reg_keyinput = input;
+    gba->reg_keyinput = input;
+
+    if (gba->profiling_enabled) {
+        run_profiled_frame();
+        return (uint16_t *)gba->frame;
+    }
 
     int total_cycles = 0;
     while (total_cycles < CYCLES_PER_FRAME) {
@@ -1386,5 +1428,8 @@ uint16_t* compute_frame(uint16_t input) {
         total_cycles += cycles_passed;
     }
 
-    return frame;
+    // the render thread (if enabled) has to finish drawing before the frame is handed out
+    flush_ppu();
+
+    return (uint16_t *)gba->frame;
 }
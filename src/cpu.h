@@ -9,8 +9,66 @@
 #ifndef CPU_H
 #define CPU_H
 
+#include <stdint.h>
+#include "cpu_utils.h"
+
+typedef struct {
+    Word r0;
+    Word r1;
+    Word r2;
+    Word r3;
+    Word r4;
+    Word r5;
+    Word r6;
+    Word r7;
+    Word r8;
+    Word r9;
+    Word r10;
+    Word r11;
+    Word r12;
+
+    Word r13;  // SP (Stack pointer)
+    Word r14;  // LR (Link register)
+    Word r15;  // PC (Program counter)
+    Word r8_fiq;
+    Word r9_fiq;
+    Word r10_fiq;
+    Word r11_fiq;
+    Word r12_fiq;
+    Word r13_fiq;
+    Word r14_fiq;
+    Word r13_svc;
+    Word r14_svc;
+    Word r13_abt;
+    Word r14_abt;
+    Word r13_irq;
+    Word r14_irq;
+    Word r13_und;
+    Word r14_und;
+
+    Word cpsr;
+    Word spsr_fiq;
+    Word spsr_svc;
+    Word spsr_abt;
+    Word spsr_irq;
+    Word spsr_und;
+} RegisterSet;
+
+
+// where the time of the last frame run went, only measured while profiling is enabled. the PPU's per
+// cycle timing is counted as part of the CPU state it ran in
+typedef struct {
+    uint32_t arm_instructions;
+    uint32_t thumb_instructions;
+    double arm_seconds;
+    double thumb_seconds;
+    double ppu_draw_seconds; // drawing scanlines on the emulation thread, or waiting on the render thread
+} FrameProfile;
+
 void init_GBA(const char *rom_file, const char *bios_file);
+void reset_cpu(void);
 
 uint16_t* compute_frame(uint16_t key_input);
+void enable_profiling(bool enable);
 
 #endif
@@ -1,4 +1,8 @@
+#ifndef CPU_UTILS_H
+#define CPU_UTILS_H
+
 #include <stdint.h>
+#include <stdbool.h>
 
 typedef uint32_t Word;
 typedef uint16_t HalfWord;
@@ -30,6 +34,7 @@ typedef enum {
     THUMB_RELATIVE_ADDRESS,
     THUMB_LONG_BRANCH_1,
     THUMB_LONG_BRANCH_2,
+    THUMB_BREAKPOINT,
 
     ARM_BAD_INSTR,
     THUMB_BAD_INSTR,
@@ -48,3 +53,5 @@ typedef enum {
 typedef enum {
     N, Z, C, V
 } Flag;
+
+#endif
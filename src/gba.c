@@ -0,0 +1,288 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "gba.h"
+
+__thread GBA *gba = NULL;
+__thread jmp_buf *gba_error_handler = NULL;
+
+_Static_assert(GBA_STATE_SIZE <= (STATE_PAGES << STATE_PAGE_SHIFT), "STATE_PAGES doesn't cover the machine state");
+_Static_assert(offsetof(GBA, internal_wram) == offsetof(GBA, external_wram) + sizeof(((GBA *)0)->external_wram), "wram is hashed as one region");
+
+static uint64_t last_instance_id = 0;
+
+void gba_fatal(void) {
+    if (gba_error_handler != NULL)
+        longjmp(*gba_error_handler, 1);
+
+    exit(1);
+}
+
+GBA *gba_create(const char *rom_file, const char *bios_file) {
+    GBA *instance = calloc(1, sizeof(GBA));
+    if (instance == NULL) {
+        fprintf(stderr, "ERROR: failed to allocate a GBA instance\n");
+        gba_fatal();
+    }
+
+    gba = instance;
+    instance->id = __atomic_add_fetch(&last_instance_id, 1, __ATOMIC_RELAXED);
+    instance->write_epoch = 1; // pages never written since power on stay at 0
+    init_ppu();
+    init_GBA(rom_file, bios_file);
+
+    return instance;
+}
+
+uint16_t *gba_run_frame(GBA *instance, uint16_t key_input) {
+    gba = instance;
+    return compute_frame(key_input);
+}
+
+void gba_destroy(GBA *instance) {
+    gba = instance;
+    enable_threaded_ppu(false);
+    release_rom(instance->rom_image);
+
+    free(instance);
+    gba = NULL;
+}
+
+void gba_save_state(GBA *instance, void *buffer) {
+    gba = instance;
+    sync_ppu();
+
+    SavestateHeader header = { SAVESTATE_MAGIC, SAVESTATE_VERSION, GBA_STATE_SIZE, 0 };
+    memcpy(buffer, &header, sizeof(header));
+    memcpy((uint8_t *)buffer + sizeof(header), instance, GBA_STATE_SIZE);
+}
+
+bool gba_load_state(GBA *instance, const void *buffer, size_t size) {
+    SavestateHeader header;
+    if (size != SAVESTATE_SIZE)
+        return false;
+
+    memcpy(&header, buffer, sizeof(header));
+    if ((header.magic != SAVESTATE_MAGIC) || (header.version != SAVESTATE_VERSION) || (header.state_size != GBA_STATE_SIZE))
+        return false;
+
+    gba = instance;
+    sync_ppu();
+
+    memcpy(instance, (const uint8_t *)buffer + sizeof(header), GBA_STATE_SIZE);
+    instance->replaced_epoch = ++instance->write_epoch;
+    invalidate_ppu();
+
+    return true;
+}
+
+GBA *gba_fork(GBA *parent) {
+    GBA *child = calloc(1, sizeof(GBA));
+    if (child == NULL) {
+        fprintf(stderr, "ERROR: failed to allocate a GBA instance\n");
+        gba_fatal();
+    }
+
+    gba = child;
+    child->id = __atomic_add_fetch(&last_instance_id, 1, __ATOMIC_RELAXED);
+    child->write_epoch = 1;
+    init_ppu();
+
+    gba_fork_into(parent, child);
+    return child;
+}
+
+static void copy_state(GBA *parent, GBA *child, size_t start, size_t end) {
+    memcpy((uint8_t *)child + start, (const uint8_t *)parent + start, end - start);
+}
+
+// the part of the tracked region [offset, offset + size) that lies in the page
+static void page_part(size_t page, size_t offset, size_t size, size_t *start, size_t *end) {
+    *start = (page << STATE_PAGE_SHIFT) > offset ? (page << STATE_PAGE_SHIFT) : offset;
+    *end = ((page + 1) << STATE_PAGE_SHIFT) < offset + size ? ((page + 1) << STATE_PAGE_SHIFT) : offset + size;
+}
+
+// copies the pages of a tracked region that either instance wrote since the child was last forked
+static void copy_written_pages(GBA *parent, GBA *child, size_t offset, size_t size) {
+    for (size_t page = offset >> STATE_PAGE_SHIFT; (page << STATE_PAGE_SHIFT) < offset + size; page++) {
+        if ((parent->page_epoch[page] <= child->fork_parent_epoch) && (child->page_epoch[page] <= child->fork_epoch))
+            continue;
+
+        size_t start, end;
+        page_part(page, offset, size, &start, &end);
+        copy_state(parent, child, start, end);
+
+        if (offset == offsetof(GBA, vram))
+            invalidate_ppu_vram(start - offset, end - start);
+    }
+}
+
+void gba_fork_into(GBA *parent, GBA *child) {
+    gba = parent;
+    sync_ppu();
+    gba = child;
+    sync_ppu();
+
+    if (child->rom_image != parent->rom_image) {
+        retain_rom(parent->rom_image);
+        release_rom(child->rom_image);
+        child->rom_image = parent->rom_image;
+        child->rom = parent->rom;
+        child->rom_size = parent->rom_size;
+        memcpy(child->bios, parent->bios, sizeof(child->bios));
+    }
+
+    bool up_to_date = (child->fork_parent_id == parent->id) && (parent->replaced_epoch <= child->fork_parent_epoch) && (child->replaced_epoch <= child->fork_epoch);
+
+    if (up_to_date) {
+        // everything besides the three tracked regions is small enough to copy every time
+        copy_state(parent, child, 0, offsetof(GBA, external_wram));
+        copy_state(parent, child, offsetof(GBA, external_wram) + sizeof(parent->external_wram), offsetof(GBA, internal_wram));
+        copy_state(parent, child, offsetof(GBA, internal_wram) + sizeof(parent->internal_wram), offsetof(GBA, vram));
+        copy_state(parent, child, offsetof(GBA, vram) + sizeof(parent->vram), GBA_STATE_SIZE);
+
+        copy_written_pages(parent, child, offsetof(GBA, external_wram), sizeof(parent->external_wram));
+        copy_written_pages(parent, child, offsetof(GBA, internal_wram), sizeof(parent->internal_wram));
+        copy_written_pages(parent, child, offsetof(GBA, vram), sizeof(parent->vram));
+
+        // the live view pointers were just copied from the parent
+        invalidate_ppu_vram(0, 0);
+    } else {
+        memcpy(child, parent, GBA_STATE_SIZE);
+        invalidate_ppu();
+    }
+
+    // as far as resetting it goes, all of the child's state was overwritten
+    child->replaced_epoch = child->write_epoch;
+    child->fork_parent_id = parent->id;
+    child->fork_parent_epoch = parent->write_epoch++;
+    child->fork_epoch = child->write_epoch++;
+}
+
+static void clear_state(GBA *instance, size_t start, size_t end) {
+    memset((uint8_t *)instance + start, 0, end - start);
+}
+
+// clears the pages of a tracked region written since the last reset, or all of it
+static void clear_written_pages(GBA *instance, size_t offset, size_t size, bool all) {
+    for (size_t page = offset >> STATE_PAGE_SHIFT; (page << STATE_PAGE_SHIFT) < offset + size; page++) {
+        if (!all && (instance->page_epoch[page] <= instance->reset_epoch))
+            continue;
+
+        size_t start, end;
+        page_part(page, offset, size, &start, &end);
+        clear_state(instance, start, end);
+
+        if (offset == offsetof(GBA, vram))
+            invalidate_ppu_vram(start - offset, end - start);
+    }
+}
+
+void gba_reset(GBA *instance) {
+    gba = instance;
+    sync_ppu();
+
+    // after a savestate was loaded or the instance was forked into, any page can hold anything
+    bool all = instance->replaced_epoch > instance->reset_epoch;
+
+    clear_state(instance, 0, offsetof(GBA, external_wram));
+    clear_state(instance, offsetof(GBA, external_wram) + sizeof(instance->external_wram), offsetof(GBA, internal_wram));
+    clear_state(instance, offsetof(GBA, internal_wram) + sizeof(instance->internal_wram), offsetof(GBA, vram));
+    clear_state(instance, offsetof(GBA, vram) + sizeof(instance->vram), GBA_STATE_SIZE);
+
+    clear_written_pages(instance, offsetof(GBA, external_wram), sizeof(instance->external_wram), all);
+    clear_written_pages(instance, offsetof(GBA, internal_wram), sizeof(instance->internal_wram), all);
+    clear_written_pages(instance, offsetof(GBA, vram), sizeof(instance->vram), all);
+
+    invalidate_ppu_vram(0, 0);
+    reset_cpu();
+
+    // frame skipping starts over as it did at power on
+    set_frame_skip(instance->next_frame_skip, instance->next_frame_skip_period);
+
+    // cleared pages aren't stamped, so anything kept per page (forks, hashes) has to start over
+    instance->replaced_epoch = instance->write_epoch;
+    instance->reset_epoch = instance->write_epoch++;
+}
+
+#define HASH_PRIME_1 UINT64_C(0x9E3779B185EBCA87)
+#define HASH_PRIME_2 UINT64_C(0xC2B2AE3D27D4EB4F)
+
+static inline uint64_t hash_round(uint64_t acc, uint64_t input) {
+    acc += input * HASH_PRIME_2;
+    acc = (acc << 31) | (acc >> 33);
+    return acc * HASH_PRIME_1;
+}
+
+static inline uint64_t hash_mix(uint64_t hash) {
+    hash ^= hash >> 33;
+    hash *= HASH_PRIME_2;
+    hash ^= hash >> 29;
+    return hash ^ (hash >> 32);
+}
+
+// four independent lanes over 32 bytes at a time, so the multiplies of neighbouring words overlap
+// (or go into vector registers) instead of each waiting on the last
+static uint64_t hash_state(const GBA *instance, size_t start, size_t end) {
+    const uint8_t *data = (const uint8_t *)instance + start;
+    size_t size = end - start;
+    uint64_t lanes[4] = { HASH_PRIME_1 + HASH_PRIME_2, HASH_PRIME_2, 0, -HASH_PRIME_1 };
+
+    size_t i = 0;
+    for (; i + 32 <= size; i += 32) {
+        for (int lane = 0; lane < 4; lane++) {
+            uint64_t word;
+            memcpy(&word, data + i + (lane * 8), sizeof(word));
+            lanes[lane] = hash_round(lanes[lane], word);
+        }
+    }
+
+    uint64_t hash = size;
+    for (int lane = 0; lane < 4; lane++)
+        hash = hash_round(hash, lanes[lane]);
+    for (; i < size; i++)
+        hash = (hash ^ data[i]) * HASH_PRIME_1;
+
+    return hash_mix(hash);
+}
+
+// folds in the page hashes of a tracked region, hashing again the pages written since the last call
+static uint64_t hash_written_pages(GBA *instance, size_t offset, size_t size, bool all, uint64_t hash) {
+    for (size_t page = offset >> STATE_PAGE_SHIFT; (page << STATE_PAGE_SHIFT) < offset + size; page++) {
+        if (all || (instance->page_epoch[page] > instance->hashed_epoch)) {
+            size_t start, end;
+            page_part(page, offset, size, &start, &end);
+            instance->page_hash[page] = hash_state(instance, start, end);
+        }
+        hash = hash_mix(hash ^ instance->page_hash[page]);
+    }
+
+    return hash;
+}
+
+uint64_t gba_state_hash(GBA *instance) {
+    gba = instance;
+    sync_ppu();
+
+    bool all = (instance->hashed_epoch == 0) || (instance->replaced_epoch > instance->hashed_epoch);
+
+    // registers, what's between wram and the frame buffer, oam up to the live view, and the affine latches
+    uint64_t hash = hash_state(instance, 0, offsetof(GBA, external_wram));
+    hash = hash_mix(hash ^ hash_state(instance, offsetof(GBA, internal_wram) + sizeof(instance->internal_wram), offsetof(GBA, frame)));
+    hash = hash_mix(hash ^ hash_state(instance, offsetof(GBA, vram) + sizeof(instance->vram), offsetof(GBA, live_view)));
+    hash = hash_mix(hash ^ hash_state(instance, offsetof(GBA, live_view.bg_ref_x), offsetof(GBA, live_view.bg_ref_y) + sizeof(instance->live_view.bg_ref_y)));
+
+    hash = hash_written_pages(instance, offsetof(GBA, external_wram), sizeof(instance->external_wram) + sizeof(instance->internal_wram), all, hash);
+    hash = hash_written_pages(instance, offsetof(GBA, vram), sizeof(instance->vram), all, hash);
+
+    instance->hashed_epoch = instance->write_epoch++;
+    return hash;
+}
+
+double gba_now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
@@ -0,0 +1,196 @@
+#ifndef GBA_H
+#define GBA_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include "cpu.h"
+#include "ppu.h"
+#include "memory.h"
+
+// memory is accessed a word at a time through casts, so byte arrays have to start word aligned
+#define WORD_ALIGNED __attribute__((aligned(4)))
+
+// for forking, external wram, internal wram and vram are tracked in pages of the machine state: every
+// write stamps the page it lands in with the instance's current write epoch
+#define STATE_PAGE_SHIFT 12
+#define STATE_PAGES      128
+#define MARK_STATE_WRITTEN(ptr) (gba->page_epoch[((const uint8_t *)(ptr) - (const uint8_t *)gba) >> STATE_PAGE_SHIFT] = gba->write_epoch)
+
+// all the state of one emulated GBA. the core reaches the instance being run through the thread
+// local gba pointer, so any number of instances can run side by side as long as each one is only
+// run by one thread at a time
+typedef struct GBA {
+    // machine state: every field up to bios makes up a savestate and is saved and loaded with a single
+    // memcpy, so it can't hold anything that doesn't survive being copied between instances (besides
+    // the view pointers, which are set up again after a load). new hardware state goes here
+
+    // cpu
+    RegisterSet registers;
+    Word curr_instr;
+    Word pipeline;
+    uint8_t shifter_carry;
+
+    // memory
+    uint8_t external_wram[0x40000] WORD_ALIGNED;
+    uint8_t internal_wram[0x8000] WORD_ALIGNED;
+
+    uint16_t reg_ime;
+    uint16_t reg_keyinput;
+
+    // ppu
+    uint16_t frame[FRAME_HEIGHT][FRAME_WIDTH];
+
+    uint8_t vram[0x18000] WORD_ALIGNED;
+    uint8_t oam[0x400] WORD_ALIGNED;
+    uint8_t pallete_ram[0x400] WORD_ALIGNED;
+    uint8_t ppu_mmio[0x56] WORD_ALIGNED;
+
+    uint8_t reg_vcount;
+    bool is_rendering_bitmap;
+
+    int cycles; // into the current scanline
+
+    PpuView live_view; // holds the affine reference point latches
+
+    // host side: loaded from files, derived from the machine state or only there to render it faster
+
+    uint8_t bios[0x4000] WORD_ALIGNED;
+    RomImage *rom_image;
+    const uint8_t *rom; // rom_image->data
+    uint32_t rom_size;
+
+    // a page was written since epoch e if its page_epoch (or replaced_epoch, which is bumped whenever
+    // the whole state is overwritten) is past e. a fork remembers the epochs of both instances at the
+    // time, so forking into it again only has to copy the pages either of them wrote since, and a reset
+    // only clears the pages written since the one before
+    uint64_t id; // unique within the process
+    uint64_t write_epoch;
+    uint64_t replaced_epoch;
+    uint64_t page_epoch[STATE_PAGES];
+    uint64_t reset_epoch; // the write epoch at the last reset, 0 from power on
+    uint64_t fork_parent_id; // 0 if not forked
+    uint64_t fork_parent_epoch;
+    uint64_t fork_epoch;
+
+    // hashes of the pages of the tracked regions as of hashed_epoch, for gba_state_hash()
+    uint64_t page_hash[STATE_PAGES];
+    uint64_t hashed_epoch; // 0 if never hashed
+
+    // one bit per 32 byte block, set on every write
+    uint64_t vram_dirty[VRAM_DIRTY_WORDS];
+    uint32_t pallete_dirty;
+
+    // the catch-up renderer defers scanlines until PPU visible state is about to change (or vblank),
+    // then draws them in one batch from the live memory. pending_view holds the vcount and
+    // affine reference points of the first deferred scanline
+    bool catch_up_enabled;
+    PpuView pending_view;
+    int ppu_pending_lines;
+
+    // frame skipping: frame_skip out of every frame_skip_period frames aren't drawn, plus any frame the
+    // frontend asked to drop or ran while rendering was paused. everything besides drawing (timing,
+    // latches, dirty tracking) still happens
+    int frame_skip;
+    int frame_skip_period;
+    int frame_skip_phase;
+    int next_frame_skip; // set_frame_skip() settings, applied from the next frame to begin
+    int next_frame_skip_period;
+    bool frame_skip_changed;
+    bool skip_next_frame_requested; // by skip_next_frame() during vblank, for the frame to begin next
+    bool rendering_paused;
+    bool rendering_frame;
+    bool is_frame_skipped; // whether the last frame to reach vblank was left undrawn
+
+    // static frame detection: while nothing the PPU reads from has been written since the previous
+    // frame started (and that frame was drawn), every scanline would come out identical and is left as is
+    bool ppu_state_written; // set on any write to vram, pallete ram, oam or the PPU registers
+    bool frame_is_static;
+    bool is_frame_unchanged; // whether the last frame to reach vblank is identical to the one before it
+
+    // counted by whichever thread renders and published to ppu_stats once the frame's rendering is flushed
+    PpuStats frame_stats;
+    PpuStats ppu_stats;
+
+    bool profiling_enabled;
+    FrameProfile profile;
+
+    bool bg_cache_enabled;
+    BgCache bg_cache[4];
+
+    // single producer (emulation thread), single consumer (render thread) queues. the head is
+    // only written by the producer and the tail only by the consumer
+    bool threaded_ppu_enabled;
+    pthread_t render_thread;
+    RenderMemory render_memory;
+    PpuView render_view;
+
+    ScanlineSnapshot scanline_queue[SCANLINE_QUEUE_SIZE];
+    uint32_t scanline_head;
+    uint32_t scanline_tail;
+
+    DiffBlock diff_ring[DIFF_RING_SIZE];
+    uint32_t diff_head;
+    uint32_t diff_tail;
+} GBA;
+
+// the instance the calling thread is running. set by gba_create() and gba_run_frame(), and used by
+// every other function of the core (including the PPU options in ppu.h)
+extern __thread GBA *gba;
+
+// where the calling thread goes on a fatal emulation error (bad file, invalid instruction or mode).
+// NULL by default, which exits the process. a frontend running many instances in one process can point
+// it at a jmp_buf to only fail the instance that went wrong; that instance can then only be destroyed
+extern __thread jmp_buf *gba_error_handler;
+void gba_fatal(void) __attribute__((noreturn));
+
+// a savestate is this header followed by the machine state of the GBA struct. the size doubles as a
+// check that the state was saved by a build with the same layout
+#define SAVESTATE_MAGIC   0x53414247 // "GBAS"
+#define SAVESTATE_VERSION 1
+#define GBA_STATE_SIZE    offsetof(GBA, bios)
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t state_size;
+    uint32_t reserved;
+} SavestateHeader;
+
+#define SAVESTATE_SIZE (sizeof(SavestateHeader) + GBA_STATE_SIZE)
+
+GBA *gba_create(const char *rom_file, const char *bios_file);
+uint16_t *gba_run_frame(GBA *instance, uint16_t key_input);
+void gba_destroy(GBA *instance);
+
+// buffer has to hold SAVESTATE_SIZE bytes. loading fails (leaving the instance as it was) if the
+// state wasn't saved by this version
+void gba_save_state(GBA *instance, void *buffer);
+bool gba_load_state(GBA *instance, const void *buffer, size_t size);
+
+// a new instance in the same state as the parent, sharing its ROM. PPU options aren't carried over.
+// gba_fork_into() puts an instance back into the parent's state: one forked from the same parent
+// only has the pages either of them wrote since copied (plus the few KB of registers and the frame
+// buffer), which makes branching a game into many futures cheap when the forks are reused. the
+// parent has to be run by the calling thread
+GBA *gba_fork(GBA *parent);
+void gba_fork_into(GBA *parent, GBA *child);
+
+// back to the power on state, keeping the loaded ROM and BIOS, PPU options and frame skip settings.
+// only the pages of wram and vram written since the last reset (or power on) have to be cleared
+void gba_reset(GBA *instance);
+
+// a hash of the machine state that frames depend on: the CPU, memories and PPU registers, but not the
+// frame buffer (which frame skipping leaves stale) or anything only the renderer uses. only pages
+// written since the last call are hashed again, so it's cheap enough to check every frame for desyncs
+uint64_t gba_state_hash(GBA *instance);
+
+// how long a frame lasts on hardware (the GBA refreshes at ~59.73Hz)
+#define FRAME_PERIOD_SECONDS (280896.0 / 16777216.0)
+
+// monotonic wall clock time, for the frontends' pacing and timing and the core's profiling
+double gba_now_seconds(void);
+
+#endif
@@ -0,0 +1,22 @@
+#include "hash.h"
+#include "ppu.h"
+
+uint64_t hash_bytes(const void *data, size_t size) {
+    const uint8_t *bytes = data;
+    uint64_t hash = 0xCBF29CE484222325;
+
+    for (size_t i = 0; i < size; i++) {
+        hash ^= bytes[i];
+        hash *= 0x100000001B3;
+    }
+
+    return hash;
+}
+
+uint64_t hash_frame(const uint16_t *frame) {
+    return hash_bytes(frame, FRAME_WIDTH * FRAME_HEIGHT * sizeof(uint16_t));
+}
+
+uint64_t hash_rom(const GBA *instance) {
+    return hash_bytes(instance->rom, instance->rom_size);
+}
@@ -0,0 +1,15 @@
+#ifndef HASH_H
+#define HASH_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "gba.h"
+
+// 64-bit FNV-1a
+uint64_t hash_bytes(const void *data, size_t size);
+// over the frame as stored (15bpp BGR, host byte order)
+uint64_t hash_frame(const uint16_t *frame);
+// identifies the ROM loaded, for movies and netplay to check they run the same game
+uint64_t hash_rom(const GBA *instance);
+
+#endif
@@ -0,0 +1,423 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "gba.h"
+#include "input_script.h"
+#include "hash.h"
+#include "movie.h"
+#include "netplay.h"
+
+#define SCREEN_HEIGHT 160
+#define SCREEN_WIDTH  240
+
+typedef enum {
+    OUTPUT_HASH,
+    OUTPUT_PPM,
+    OUTPUT_RAW
+} OutputMode;
+
+static void usage(void) {
+    fprintf(stderr,
+        "usage: gbac-headless [options] <rom_file> [frames]\n"
+        "  --bios <file>            BIOS image (default bios.bin)\n"
+        "  --input <file>           input script, lines of \"<frame> [keys...]\"\n"
+        "                           keys are A B SELECT START RIGHT LEFT UP DOWN R L\n"
+        "  --output hash|ppm|raw    what to write out (default hash)\n"
+        "  --every <n>              hash or dump every n-th frame (default only the last)\n"
+        "  --load-state <file>      start from a savestate instead of power on\n"
+        "  --save-state <file>      save the state after the last frame\n"
+        "  --record <file>          record the keys of every frame run to an input movie\n"
+        "  --replay <file>          take the start state and keys from an input movie and report\n"
+        "                           the speed it ran at. frames defaults to the movie's length\n"
+        "  --state-log <file>       write a hash of the machine state after every frame\n"
+        "  --netplay-loopback <latency_ms>/<jitter_ms>\n"
+        "                           run a rollback netplay session between two instances over\n"
+        "                           localhost UDP, player 2 taking its keys from --peer-input,\n"
+        "                           and check that both end up in the same state\n"
+        "  --peer-input <file>      input script of player 2\n"
+        "  --out <path>             raw: output file, - for stdout (default)\n"
+        "                           ppm: file name prefix (default frame)\n"
+        "  --frame-skip <n>/<m>     skip drawing n of every m frames (emulation is unaffected)\n"
+        "  --no-render              never draw frames, only emulate (the frames written out are stale)\n"
+        "  --bg-cache, --threaded-ppu, --catch-up-ppu\n"
+        "                           same as for gbac\n");
+    exit(1);
+}
+
+static void write_ppm(const char *prefix, int frame_number, const uint16_t *frame) {
+    char file_name[1024];
+    snprintf(file_name, sizeof(file_name), "%s_%06d.ppm", prefix, frame_number);
+
+    FILE *fp = fopen(file_name, "wb");
+    if (fp == NULL) {
+        fprintf(stderr, "ERROR: failed to create %s\n", file_name);
+        exit(1);
+    }
+
+    // 15bpp BGR expanded to 24bpp RGB
+    uint8_t row[SCREEN_WIDTH * 3];
+    fprintf(fp, "P6\n%d %d\n255\n", SCREEN_WIDTH, SCREEN_HEIGHT);
+    for (int y = 0; y < SCREEN_HEIGHT; y++) {
+        for (int x = 0; x < SCREEN_WIDTH; x++) {
+            uint16_t color = frame[(y * SCREEN_WIDTH) + x];
+            row[(x * 3) + 0] = (color & 0x1F) << 3;
+            row[(x * 3) + 1] = ((color >> 5) & 0x1F) << 3;
+            row[(x * 3) + 2] = ((color >> 10) & 0x1F) << 3;
+        }
+        fwrite(row, sizeof(row), 1, fp);
+    }
+
+    fclose(fp);
+}
+
+// the keys held in every frame run, as the main loop takes them from an input script
+static uint16_t *script_keys(const char *input_file, int num_frames) {
+    int num_events = 0;
+    InputEvent *events = input_file ? load_input_script(input_file, &num_events) : NULL;
+    uint16_t *keys = malloc(num_frames * sizeof(uint16_t));
+
+    uint16_t key_input = 0xFFFF;
+    int next_event = 0;
+    for (int frame_number = 1; frame_number <= num_frames; frame_number++) {
+        while ((next_event < num_events) && (events[next_event].frame < frame_number))
+            key_input = events[next_event++].keys;
+        keys[frame_number - 1] = key_input;
+    }
+
+    free(events);
+    return keys;
+}
+
+typedef struct {
+    GBA *instance;
+    Netplay *netplay;
+    const uint16_t *keys;
+    int num_frames;
+} NetplayPeer;
+
+static int peers_settled = 0;
+
+// paced to the GBA's frame rate as in a real session, so that latency is worth as many frames. once
+// every frame has run, input keeps being exchanged until both sides have all of it
+static void *run_netplay_peer(void *arg) {
+    NetplayPeer *peer = arg;
+    struct timespec pause = { 0, 500000 };
+    double deadline = gba_now_seconds();
+
+    for (int frame = 0; frame < peer->num_frames; ) {
+        if (netplay_run_frame(peer->netplay, peer->keys[frame]) == NULL) {
+            nanosleep(&pause, NULL);
+            continue;
+        }
+        frame++;
+
+        deadline += FRAME_PERIOD_SECONDS;
+        double wait = deadline - gba_now_seconds();
+        if (wait > 0) {
+            struct timespec until_deadline = { (time_t)wait, (long)((wait - (time_t)wait) * 1e9) };
+            nanosleep(&until_deadline, NULL);
+        }
+    }
+
+    bool settled = false;
+    while (__atomic_load_n(&peers_settled, __ATOMIC_ACQUIRE) < 2) {
+        if (netplay_poll(peer->netplay) && !settled) {
+            settled = true;
+            __atomic_add_fetch(&peers_settled, 1, __ATOMIC_ACQ_REL);
+        }
+        nanosleep(&pause, NULL);
+    }
+
+    return NULL;
+}
+
+// the two players' keys are combined, so a run of the same keys without netplay has to end in the same state
+static int run_netplay_loopback(const char *rom_file, const char *bios_file, uint16_t *keys[2], int num_frames, int latency, int jitter) {
+    NetplayPeer peers[2];
+    pthread_t threads[2];
+
+    for (int i = 0; i < 2; i++) {
+        GBA *instance = gba_create(rom_file, bios_file);
+        peers[i] = (NetplayPeer){ instance, netplay_create(instance, 0), keys[i], num_frames };
+        netplay_simulate_delay(peers[i].netplay, latency, jitter);
+    }
+    netplay_connect(peers[0].netplay, "127.0.0.1", netplay_local_port(peers[1].netplay));
+    netplay_connect(peers[1].netplay, "127.0.0.1", netplay_local_port(peers[0].netplay));
+
+    for (int i = 0; i < 2; i++) {
+        if (pthread_create(&threads[i], NULL, run_netplay_peer, &peers[i]) != 0) {
+            fprintf(stderr, "ERROR: failed to start netplay thread\n");
+            exit(1);
+        }
+    }
+    for (int i = 0; i < 2; i++)
+        pthread_join(threads[i], NULL);
+
+    GBA *reference = gba_create(rom_file, bios_file);
+    for (int frame = 0; frame < num_frames; frame++)
+        gba_run_frame(reference, keys[0][frame] & keys[1][frame]);
+    uint64_t expected = gba_state_hash(reference);
+    gba_destroy(reference);
+
+    int status = 0;
+    for (int i = 0; i < 2; i++) {
+        NetplayStats *stats = &peers[i].netplay->stats;
+        uint64_t hash = gba_state_hash(peers[i].instance);
+        double resimulation_fps = (stats->resimulation_seconds > 0) ? (stats->frames_resimulated / stats->resimulation_seconds) : 0;
+
+        printf("player %d: %d rollbacks (longest %d frames), %d frames re-simulated at %.1f frames/s, %d stalls, state %016llx %s\n",
+            i + 1, stats->rollbacks, stats->longest_rollback, stats->frames_resimulated, resimulation_fps, stats->stalls,
+            (unsigned long long)hash, (hash == expected) ? "in sync" : "DESYNCED");
+        if (hash != expected)
+            status = 1;
+
+        netplay_destroy(peers[i].netplay);
+        gba_destroy(peers[i].instance);
+    }
+
+    return status;
+}
+
+static void load_state_file(GBA *instance, const char *state_file) {
+    FILE *fp = fopen(state_file, "rb");
+    if (fp == NULL) {
+        fprintf(stderr, "ERROR: failed to open savestate %s\n", state_file);
+        exit(1);
+    }
+
+    // one byte more than a savestate, so a longer file doesn't pass as one
+    uint8_t *state = malloc(SAVESTATE_SIZE + 1);
+    size_t size = fread(state, 1, SAVESTATE_SIZE + 1, fp);
+    fclose(fp);
+
+    if (!gba_load_state(instance, state, size)) {
+        fprintf(stderr, "ERROR: %s isn't a savestate from this version\n", state_file);
+        exit(1);
+    }
+    free(state);
+}
+
+static void save_state_file(GBA *instance, const char *state_file) {
+    FILE *fp = fopen(state_file, "wb");
+    if (fp == NULL) {
+        fprintf(stderr, "ERROR: failed to create %s\n", state_file);
+        exit(1);
+    }
+
+    uint8_t *state = malloc(SAVESTATE_SIZE);
+    gba_save_state(instance, state);
+    fwrite(state, 1, SAVESTATE_SIZE, fp);
+
+    fclose(fp);
+    free(state);
+}
+
+int main(int argc, char **argv) {
+    char *rom_file = NULL;
+    char *bios_file = "bios.bin";
+    char *input_file = NULL;
+    char *out_path = NULL;
+    char *load_state = NULL;
+    char *save_state = NULL;
+    char *record_file = NULL;
+    char *replay_file = NULL;
+    char *state_log_file = NULL;
+    char *peer_input_file = NULL;
+    bool netplay_loopback = false;
+    int netplay_latency = 0;
+    int netplay_jitter = 0;
+    OutputMode output_mode = OUTPUT_HASH;
+    int num_frames = -1;
+    int every = 0;
+    int frame_skip = 0;
+    int frame_skip_period = 1;
+    bool use_bg_cache = false;
+    bool use_threaded_ppu = false;
+    bool use_catch_up_ppu = false;
+
+    for (int i = 1; i < argc; i++) {
+        bool has_value = i + 1 < argc;
+
+        if ((strcmp(argv[i], "--bios") == 0) && has_value) {
+            bios_file = argv[++i];
+        } else if ((strcmp(argv[i], "--input") == 0) && has_value) {
+            input_file = argv[++i];
+        } else if ((strcmp(argv[i], "--output") == 0) && has_value) {
+            i++;
+            if (strcmp(argv[i], "hash") == 0) {
+                output_mode = OUTPUT_HASH;
+            } else if (strcmp(argv[i], "ppm") == 0) {
+                output_mode = OUTPUT_PPM;
+            } else if (strcmp(argv[i], "raw") == 0) {
+                output_mode = OUTPUT_RAW;
+            } else {
+                usage();
+            }
+        } else if ((strcmp(argv[i], "--every") == 0) && has_value) {
+            every = atoi(argv[++i]);
+            if (every < 1) usage();
+        } else if ((strcmp(argv[i], "--load-state") == 0) && has_value) {
+            load_state = argv[++i];
+        } else if ((strcmp(argv[i], "--save-state") == 0) && has_value) {
+            save_state = argv[++i];
+        } else if ((strcmp(argv[i], "--record") == 0) && has_value) {
+            record_file = argv[++i];
+        } else if ((strcmp(argv[i], "--replay") == 0) && has_value) {
+            replay_file = argv[++i];
+        } else if ((strcmp(argv[i], "--state-log") == 0) && has_value) {
+            state_log_file = argv[++i];
+        } else if ((strcmp(argv[i], "--netplay-loopback") == 0) && has_value) {
+            netplay_loopback = true;
+            if ((sscanf(argv[++i], "%d/%d", &netplay_latency, &netplay_jitter) != 2) || (netplay_latency < 0) || (netplay_jitter < 0))
+                usage();
+        } else if ((strcmp(argv[i], "--peer-input") == 0) && has_value) {
+            peer_input_file = argv[++i];
+        } else if ((strcmp(argv[i], "--out") == 0) && has_value) {
+            out_path = argv[++i];
+        } else if ((strcmp(argv[i], "--frame-skip") == 0) && has_value) {
+            if ((sscanf(argv[++i], "%d/%d", &frame_skip, &frame_skip_period) != 2) || (frame_skip_period < 1) || (frame_skip < 0) || (frame_skip > frame_skip_period))
+                usage();
+        } else if (strcmp(argv[i], "--no-render") == 0) {
+            frame_skip = 1;
+            frame_skip_period = 1;
+        } else if (strcmp(argv[i], "--bg-cache") == 0) {
+            use_bg_cache = true;
+        } else if (strcmp(argv[i], "--threaded-ppu") == 0) {
+            use_threaded_ppu = true;
+        } else if (strcmp(argv[i], "--catch-up-ppu") == 0) {
+            use_catch_up_ppu = true;
+        } else if (argv[i][0] == '-') {
+            usage();
+        } else if (rom_file == NULL) {
+            rom_file = argv[i];
+        } else if (num_frames < 0) {
+            num_frames = atoi(argv[i]);
+        } else {
+            usage();
+        }
+    }
+
+    // a movie brings its own start state and keys
+    if ((rom_file == NULL) || ((replay_file != NULL) && ((input_file != NULL) || (load_state != NULL))))
+        usage();
+
+    Movie *replay = replay_file ? movie_load(replay_file) : NULL;
+    if ((num_frames < 0) && (replay != NULL))
+        num_frames = replay->num_frames;
+    if (num_frames < 1)
+        usage();
+
+    // both players start from power on
+    if (netplay_loopback) {
+        if ((replay != NULL) || (load_state != NULL))
+            usage();
+
+        uint16_t *keys[2] = { script_keys(input_file, num_frames), script_keys(peer_input_file, num_frames) };
+        int status = run_netplay_loopback(rom_file, bios_file, keys, num_frames, netplay_latency, netplay_jitter);
+        free(keys[0]);
+        free(keys[1]);
+        return status;
+    }
+
+    // by default only the last frame is written out
+    if (every == 0)
+        every = num_frames;
+
+    int num_events = 0;
+    InputEvent *events = input_file ? load_input_script(input_file, &num_events) : NULL;
+
+    FILE *raw_out = NULL;
+    if (output_mode == OUTPUT_RAW) {
+        raw_out = ((out_path == NULL) || (strcmp(out_path, "-") == 0)) ? stdout : fopen(out_path, "wb");
+        if (raw_out == NULL) {
+            fprintf(stderr, "ERROR: failed to create %s\n", out_path);
+            exit(1);
+        }
+    }
+
+    FILE *state_log = NULL;
+    if ((state_log_file != NULL) && ((state_log = fopen(state_log_file, "w")) == NULL)) {
+        fprintf(stderr, "ERROR: failed to create %s\n", state_log_file);
+        exit(1);
+    }
+
+    GBA *instance = gba_create(rom_file, bios_file);
+    set_frame_skip(frame_skip, frame_skip_period);
+    enable_bg_cache(use_bg_cache);
+    enable_threaded_ppu(use_threaded_ppu);
+    enable_catch_up_ppu(use_catch_up_ppu);
+
+    if (load_state != NULL)
+        load_state_file(instance, load_state);
+    if (replay != NULL)
+        movie_start(replay, instance);
+
+    bool from_power_on = (load_state == NULL) && ((replay == NULL) || (replay->start_state == NULL));
+    Movie *recording = record_file ? movie_create(instance, from_power_on) : NULL;
+
+    uint16_t key_input = 0xFFFF;
+    int next_event = 0;
+    double start = gba_now_seconds();
+
+    // frames are numbered from 1, as in the number of frames run so far
+    for (int frame_number = 1; frame_number <= num_frames; frame_number++) {
+        while ((next_event < num_events) && (events[next_event].frame < frame_number))
+            key_input = events[next_event++].keys;
+
+        // past the end of the movie no keys are held
+        if (replay != NULL)
+            key_input = (frame_number <= replay->num_frames) ? replay->keys[frame_number - 1] : 0xFFFF;
+        if (recording != NULL)
+            movie_record_frame(recording, key_input);
+
+        uint16_t *frame = gba_run_frame(instance, key_input);
+
+        if (state_log != NULL)
+            fprintf(state_log, "%d %016llx\n", frame_number, (unsigned long long)gba_state_hash(instance));
+
+        switch (output_mode) {
+        case OUTPUT_HASH:
+            if ((frame_number % every) == 0)
+                printf("%d %016llx\n", frame_number, (unsigned long long)hash_frame(frame));
+            break;
+        case OUTPUT_PPM:
+            if ((frame_number % every) == 0)
+                write_ppm(out_path ? out_path : "frame", frame_number, frame);
+            break;
+        case OUTPUT_RAW:
+            if ((frame_number % every) == 0)
+                fwrite(frame, sizeof(uint16_t), SCREEN_WIDTH * SCREEN_HEIGHT, raw_out);
+            break;
+        }
+    }
+
+    double seconds = gba_now_seconds() - start;
+
+    if (raw_out != NULL)
+        fclose(raw_out);
+    if (state_log != NULL)
+        fclose(state_log);
+
+    if (replay != NULL) {
+        fprintf(stderr, "replayed %d frames in %.2fs: %.1f frames/s\n", num_frames, seconds, num_frames / seconds);
+        movie_destroy(replay);
+    }
+
+    if (recording != NULL) {
+        movie_save(recording, record_file);
+        movie_destroy(recording);
+    }
+
+    if (save_state != NULL)
+        save_state_file(instance, save_state);
+
+    gba_destroy(instance);
+    free(events);
+
+    return 0;
+}
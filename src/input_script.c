@@ -0,0 +1,61 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "input_script.h"
+
+#define MAX_INPUT_LINE 256
+
+static const char *key_names[] = { "A", "B", "SELECT", "START", "RIGHT", "LEFT", "UP", "DOWN", "R", "L" };
+
+// each line holds a frame count followed by the keys held down once that many frames have run,
+// up until the next line. blank lines and lines starting with # are ignored
+InputEvent *load_input_script(const char *input_file, int *num_events) {
+    FILE *fp = fopen(input_file, "r");
+    if (fp == NULL) {
+        fprintf(stderr, "ERROR: failed to open input script %s\n", input_file);
+        exit(1);
+    }
+
+    InputEvent *events = NULL;
+    int capacity = 0;
+    char line[MAX_INPUT_LINE];
+    int line_number = 0;
+
+    *num_events = 0;
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        line_number++;
+
+        char *token = strtok(line, " \t\r\n");
+        if ((token == NULL) || (token[0] == '#'))
+            continue;
+
+        char *end;
+        long frame_number = strtol(token, &end, 10);
+        if ((*end != '\0') || (frame_number < 0) || ((*num_events > 0) && (frame_number < events[*num_events - 1].frame))) {
+            fprintf(stderr, "ERROR: %s:%d: expected a frame number no lower than the previous one\n", input_file, line_number);
+            exit(1);
+        }
+
+        uint16_t keys = 0xFFFF;
+        while ((token = strtok(NULL, " \t\r\n")) != NULL) {
+            int key = 0;
+            while ((key < 10) && (strcmp(token, key_names[key]) != 0))
+                key++;
+
+            if (key == 10) {
+                fprintf(stderr, "ERROR: %s:%d: unknown key %s\n", input_file, line_number, token);
+                exit(1);
+            }
+            keys &= ~(1 << key);
+        }
+
+        if (*num_events == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            events = realloc(events, capacity * sizeof(InputEvent));
+        }
+        events[(*num_events)++] = (InputEvent){ (int)frame_number, keys };
+    }
+
+    fclose(fp);
+    return events;
+}
@@ -0,0 +1,15 @@
+#ifndef INPUT_SCRIPT_H
+#define INPUT_SCRIPT_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// keys held from a given frame onwards, active low like KEYINPUT
+typedef struct {
+    int frame;
+    uint16_t keys;
+} InputEvent;
+
+InputEvent *load_input_script(const char *input_file, int *num_events);
+
+#endif
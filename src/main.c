@@ -1,44 +1,177 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <string.h>
 #include <SDL.h>
-#include "cpu.h"
+#include "gba.h"
+#include "rewind.h"
+#include "movie.h"
+#include "netplay.h"
 
 #define SCREEN_HEIGHT 160
 #define SCREEN_WIDTH  240
 #define PIXEL_SIZE 3
 
-#define RGB_VALUE(n) (((n) << 3) | ((n) >> 2))
+// most frames auto frame skip will drop in a row, so the screen keeps updating on slow hosts
+#define MAX_AUTO_SKIPPED_FRAMES 4
+// number of frames --ppu-stats sums up per report (about a second)
+#define STATS_PERIOD_FRAMES 60
+// --rewind takes a snapshot every REWIND_INTERVAL frames and keeps as many as fit in REWIND_BUFFER_SIZE
+#define REWIND_INTERVAL 4
+#define REWIND_BUFFER_SIZE (64 << 20)
+
+// where the time of a frame with --run-ahead goes, summed over STATS_PERIOD_FRAMES
+typedef struct {
+    double emulating; // the frame itself
+    double states;    // saving and loading the state
+    double ahead;     // the frames run ahead
+} RunAheadTimes;
+
+// GBA colors are 15bpp BGR (red in the low bits) which SDL can consume as is,
+// so the frame is uploaded to a texture without any per pixel conversion.
+// an unchanged frame is already in the texture and doesn't need to be uploaded again
+void sdl_render_frame(SDL_Renderer *renderer, SDL_Texture *texture, uint16_t *frame, bool frame_changed) {
+    if (frame_changed)
+        SDL_UpdateTexture(texture, NULL, frame, SCREEN_WIDTH * sizeof(uint16_t));
 
-void sdl_render_frame(SDL_Renderer *renderer, uint16_t *frame) {
     SDL_RenderClear(renderer); // clear the previous frame
+    SDL_RenderCopy(renderer, texture, NULL, NULL);
+    SDL_RenderPresent(renderer); // render the new frame
+}
 
-    SDL_Rect lcd[SCREEN_WIDTH * SCREEN_HEIGHT];
+// runs the frame for real without drawing it, then runs frames more ahead of it with the same input
+// and returns the last of them, so input shows up that many frames sooner. the instance is put back to
+// the real frame afterwards, so the returned frame is copied out to ahead_frame (which keeps the
+// previous one if the last frame ahead was left undrawn, by --frame-skip for instance)
+static uint16_t *run_frame_ahead(GBA *instance, uint16_t key_input, int frames, uint8_t *state, uint16_t *ahead_frame, RunAheadTimes *times) {
+    double start = gba_now_seconds();
+    skip_next_frame();
+    gba_run_frame(instance, key_input);
 
-    for (int i = 0; i < SCREEN_HEIGHT; i++) {
-        for (int j = 0; j < SCREEN_WIDTH; j++) {
-            lcd[(i * 240) + j].w = PIXEL_SIZE;
-            lcd[(i * 240) + j].h = PIXEL_SIZE;
-            lcd[(i * 240) + j].x = j * PIXEL_SIZE;
-            lcd[(i * 240) + j].y = i * PIXEL_SIZE;
-        }
-    }
+    double saving = gba_now_seconds();
+    gba_save_state(instance, state);
 
-    for (int i = 0; i < SCREEN_WIDTH * SCREEN_HEIGHT; i++) {
-        SDL_SetRenderDrawColor(renderer, RGB_VALUE(frame[i] & 0x1F), RGB_VALUE((frame[i] >> 5) & 0x1F), RGB_VALUE(((frame[i] >> 10) & 0x1F)), 255);
-        SDL_RenderFillRect(renderer, &lcd[i]);
+    double ahead = gba_now_seconds();
+    uint16_t *frame = NULL;
+    for (int i = 1; i <= frames; i++) {
+        // only the last frame ahead is drawn
+        if (i != frames)
+            skip_next_frame();
+        frame = gba_run_frame(instance, key_input);
     }
+    if (!instance->is_frame_skipped)
+        memcpy(ahead_frame, frame, SCREEN_WIDTH * SCREEN_HEIGHT * sizeof(uint16_t));
 
-    SDL_RenderPresent(renderer); // render the new frame
+    double loading = gba_now_seconds();
+    gba_load_state(instance, state, SAVESTATE_SIZE);
+    double end = gba_now_seconds();
+
+    times->emulating += saving - start;
+    times->states += (ahead - saving) + (end - loading);
+    times->ahead += loading - ahead;
+
+    return ahead_frame;
 }
 
 int main(int argc, char **argv) {
-    if (argc <= 1) {
+    char *rom_file = NULL;
+    int frame_skip = 0;
+    int frame_skip_period = 1;
+    bool auto_frame_skip = false;
+    bool use_bg_cache = false;
+    bool use_threaded_ppu = false;
+    bool use_catch_up_ppu = false;
+    bool print_ppu_stats = false;
+    bool use_rewind = false;
+    int run_ahead = 0;
+    char *record_file = NULL;
+    char *replay_file = NULL;
+    int netplay_port = 0;
+    char netplay_host[256];
+    int netplay_remote_port = 0;
+    int netplay_latency = 0;
+    int netplay_jitter = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--frame-skip") == 0) {
+            if ((i + 1 >= argc) || (sscanf(argv[++i], "%d/%d", &frame_skip, &frame_skip_period) != 2)) {
+                fprintf(stderr, "ERROR: --frame-skip expects N/M (skip N of every M frames)\n");
+                exit(1);
+            }
+        } else if (strcmp(argv[i], "--no-render") == 0) {
+            frame_skip = 1;
+            frame_skip_period = 1;
+        } else if (strcmp(argv[i], "--auto-frame-skip") == 0) {
+            auto_frame_skip = true;
+        } else if (strcmp(argv[i], "--bg-cache") == 0) {
+            use_bg_cache = true;
+        } else if (strcmp(argv[i], "--threaded-ppu") == 0) {
+            use_threaded_ppu = true;
+        } else if (strcmp(argv[i], "--catch-up-ppu") == 0) {
+            use_catch_up_ppu = true;
+        } else if (strcmp(argv[i], "--ppu-stats") == 0) {
+            print_ppu_stats = true;
+        } else if (strcmp(argv[i], "--rewind") == 0) {
+            use_rewind = true;
+        } else if (strcmp(argv[i], "--run-ahead") == 0) {
+            if ((i + 1 >= argc) || (sscanf(argv[++i], "%d", &run_ahead) != 1) || (run_ahead < 0)) {
+                fprintf(stderr, "ERROR: --run-ahead expects a number of frames\n");
+                exit(1);
+            }
+        } else if ((strcmp(argv[i], "--record") == 0) && (i + 1 < argc)) {
+            record_file = argv[++i];
+        } else if ((strcmp(argv[i], "--replay") == 0) && (i + 1 < argc)) {
+            replay_file = argv[++i];
+        } else if (strcmp(argv[i], "--netplay") == 0) {
+            if ((i + 1 >= argc) || (sscanf(argv[++i], "%d:%255[^:]:%d", &netplay_port, netplay_host, &netplay_remote_port) != 3)) {
+                fprintf(stderr, "ERROR: --netplay expects <local_port>:<host>:<remote_port>\n");
+                exit(1);
+            }
+        } else if (strcmp(argv[i], "--netplay-delay") == 0) {
+            if ((i + 1 >= argc) || (sscanf(argv[++i], "%d/%d", &netplay_latency, &netplay_jitter) != 2)) {
+                fprintf(stderr, "ERROR: --netplay-delay expects <latency_ms>/<jitter_ms>\n");
+                exit(1);
+            }
+        } else {
+            rom_file = argv[i];
+        }
+    }
+
+    // a movie only holds the keys of frames run one after the other
+    if ((record_file || replay_file) && use_rewind) {
+        fprintf(stderr, "ERROR: --rewind can't be used with --record or --replay\n");
+        exit(1);
+    }
+
+    // both sides have to run the same frames from power on
+    if (netplay_port && (record_file || replay_file || use_rewind || run_ahead)) {
+        fprintf(stderr, "ERROR: --netplay can't be used with --record, --replay, --rewind or --run-ahead\n");
+        exit(1);
+    }
+
+    if (rom_file == NULL) {
         fprintf(stderr, "ERROR: must provide a .gba file\n");
         exit(1);
     }
 
-    init_GBA(argv[1], "bios.bin");
+    GBA *instance = gba_create(rom_file, "bios.bin");
+    set_frame_skip(frame_skip, frame_skip_period);
+    enable_bg_cache(use_bg_cache);
+    enable_threaded_ppu(use_threaded_ppu);
+    enable_catch_up_ppu(use_catch_up_ppu);
+
+    Movie *replay = replay_file ? movie_load(replay_file) : NULL;
+    if (replay != NULL)
+        movie_start(replay, instance);
+    Movie *recording = record_file ? movie_create(instance, (replay == NULL) || (replay->start_state == NULL)) : NULL;
+    int frames_run = 0;
+
+    Netplay *netplay = NULL;
+    if (netplay_port) {
+        netplay = netplay_create(instance, netplay_port);
+        netplay_connect(netplay, netplay_host, netplay_remote_port);
+        netplay_simulate_delay(netplay, netplay_latency, netplay_jitter);
+    }
 
     SDL_Window* window = NULL;
     SDL_Renderer *renderer;
@@ -62,12 +195,36 @@ int main(int argc, char **argv) {
         return EXIT_FAILURE;
     }
 
+    SDL_Texture *texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_BGR555, SDL_TEXTUREACCESS_STREAMING, SCREEN_WIDTH, SCREEN_HEIGHT);
+    if (texture == NULL) {
+        fprintf(stderr, "SDL_CreateTexture Error: %s\n", SDL_GetError());
+        SDL_DestroyRenderer(renderer);
+        SDL_DestroyWindow(window);
+        SDL_Quit();
+        return EXIT_FAILURE;
+    }
+
     SDL_Event event;
     
     bool running = true;
 
-    time_t start_t, end_t;
-    double diff_t;
+    // wall clock time at which the last frame was due, used to detect when emulation falls behind
+    double frame_deadline = gba_now_seconds();
+    int skipped_in_a_row = 0;
+
+    // F5 saves to and F7 loads from a single in-memory slot
+    uint8_t *quick_save = malloc(SAVESTATE_SIZE);
+    bool has_quick_save = false;
+
+    Rewind *rewinder = use_rewind ? rewind_create(REWIND_BUFFER_SIZE, REWIND_INTERVAL) : NULL;
+
+    uint8_t *run_ahead_state = run_ahead ? malloc(SAVESTATE_SIZE) : NULL;
+    uint16_t *ahead_frame = run_ahead ? calloc(SCREEN_WIDTH * SCREEN_HEIGHT, sizeof(uint16_t)) : NULL;
+    RunAheadTimes run_ahead_times = {0};
+    int run_ahead_frames = 0;
+
+    PpuStats stats_total = {0};
+    int stats_frames = 0;
 
     while(running)
     {
@@ -102,6 +259,14 @@ int main(int argc, char **argv) {
                 case SDLK_DOWN:
                     key_input = ~(1 << 7) & key_input;
                     break;
+                case SDLK_F5:
+                    gba_save_state(instance, quick_save);
+                    has_quick_save = true;
+                    break;
+                case SDLK_F7:
+                    if (has_quick_save && (recording == NULL) && (replay == NULL) && (netplay == NULL))
+                        gba_load_state(instance, quick_save, SAVESTATE_SIZE);
+                    break;
                 }
                 break;
             case SDL_QUIT:
@@ -110,9 +275,109 @@ int main(int argc, char **argv) {
             }
         }
         
-        sdl_render_frame(renderer, compute_frame(key_input));
+        // while R is held, each snapshot stepped back to is shown in place of running a frame
+        if ((rewinder != NULL) && SDL_GetKeyboardState(NULL)[SDL_SCANCODE_R]) {
+            bool stepped_back = rewind_step_back(rewinder, instance);
+            sdl_render_frame(renderer, texture, &instance->frame[0][0], stepped_back);
+            continue;
+        }
+
+        // the movie's keys replace the keyboard's until it runs out
+        if ((replay != NULL) && (frames_run < replay->num_frames))
+            key_input = replay->keys[frames_run];
+        if (recording != NULL)
+            movie_record_frame(recording, key_input);
+        frames_run++;
+
+        // decided before the frame runs, so that a frame that starts out late is the one dropped
+        bool skip_frame = false;
+        if (auto_frame_skip) {
+            double now = gba_now_seconds();
+
+            if ((now > frame_deadline + FRAME_PERIOD_SECONDS) && (skipped_in_a_row < MAX_AUTO_SKIPPED_FRAMES)) {
+                skip_frame = true;
+                skipped_in_a_row++;
+            } else {
+                skipped_in_a_row = 0;
+            }
+
+            // too far behind to ever catch up, start counting from now instead
+            if (now > frame_deadline + (MAX_AUTO_SKIPPED_FRAMES * FRAME_PERIOD_SECONDS))
+                frame_deadline = now;
+            frame_deadline += FRAME_PERIOD_SECONDS;
+        }
+
+        if (netplay != NULL) {
+            if (skip_frame)
+                skip_next_frame();
+            // while waiting on the other side the previous frame stays up
+            uint16_t *frame = netplay_run_frame(netplay, key_input);
+            if (frame == NULL)
+                sdl_render_frame(renderer, texture, &instance->frame[0][0], false);
+            else if (!instance->is_frame_skipped)
+                sdl_render_frame(renderer, texture, frame, true);
+        } else if (run_ahead && skip_frame) {
+            // nothing is shown, so there's nothing to run ahead for
+            skip_next_frame();
+            gba_run_frame(instance, key_input);
+        } else if (run_ahead) {
+            uint16_t *frame = run_frame_ahead(instance, key_input, run_ahead, run_ahead_state, ahead_frame, &run_ahead_times);
+            sdl_render_frame(renderer, texture, frame, true);
+
+            if (++run_ahead_frames == STATS_PERIOD_FRAMES) {
+                printf("run-ahead %d: %.2f ms/frame emulating, %.2f ms running ahead, %.3f ms saving and loading state\n",
+                    run_ahead, run_ahead_times.emulating * 1000 / STATS_PERIOD_FRAMES,
+                    run_ahead_times.ahead * 1000 / STATS_PERIOD_FRAMES, run_ahead_times.states * 1000 / STATS_PERIOD_FRAMES);
+                memset(&run_ahead_times, 0, sizeof(run_ahead_times));
+                run_ahead_frames = 0;
+            }
+        } else {
+            if (skip_frame)
+                skip_next_frame();
+            uint16_t *frame = gba_run_frame(instance, key_input);
+            if (!instance->is_frame_skipped)
+                sdl_render_frame(renderer, texture, frame, !instance->is_frame_unchanged);
+        }
+
+        if (rewinder != NULL)
+            rewind_frame(rewinder, instance);
+
+        if (print_ppu_stats) {
+            stats_total.lines_rendered += instance->ppu_stats.lines_rendered;
+            stats_total.layers_rendered += instance->ppu_stats.layers_rendered;
+            stats_total.layers_culled += instance->ppu_stats.layers_culled;
+            stats_total.tiles_culled += instance->ppu_stats.tiles_culled;
+
+            if (++stats_frames == STATS_PERIOD_FRAMES) {
+                printf("ppu: %u scanlines, %u bg layers drawn, %u culled, %u tile rows culled\n",
+                    stats_total.lines_rendered, stats_total.layers_rendered, stats_total.layers_culled, stats_total.tiles_culled);
+                memset(&stats_total, 0, sizeof(stats_total));
+                stats_frames = 0;
+            }
+        }
     }
 
+    if (recording != NULL) {
+        movie_save(recording, record_file);
+        movie_destroy(recording);
+    }
+    if (replay != NULL)
+        movie_destroy(replay);
+    if (netplay != NULL) {
+        printf("netplay: %d rollbacks (longest %d frames), %d frames re-simulated, %d stalls\n",
+            netplay->stats.rollbacks, netplay->stats.longest_rollback, netplay->stats.frames_resimulated, netplay->stats.stalls);
+        netplay_destroy(netplay);
+    }
+
+    gba_destroy(instance);
+    free(quick_save);
+    free(run_ahead_state);
+    free(ahead_frame);
+    if (rewinder != NULL)
+        rewind_destroy(rewinder);
+
+    SDL_DestroyTexture(texture);
+    SDL_DestroyRenderer(renderer);
     SDL_DestroyWindow(window);
     SDL_Quit();
 
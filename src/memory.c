@@ -1,81 +1,156 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include "memory.h"
-
-uint8_t bios[0x4000];
-uint8_t external_wram[0x40000];
-uint8_t internal_wram[0x8000];
-uint8_t rom[0x2000000];
-
-uint16_t reg_ime;
-uint16_t reg_keyinput;
+#include "gba.h"
 
 void load_bios(char *bios_file) {
     FILE *fp = fopen(bios_file, "rb");
     if (fp == NULL) {
         fprintf(stderr, "ERROR: file (%s) failed to open\n", bios_file);
-        exit(1);
+        gba_fatal();
     }
 
     fseek(fp, 0, SEEK_END);
     size_t size = ftell(fp);
     fseek(fp, 0, SEEK_SET);
 
-    fread(bios, sizeof(uint8_t), size, fp);
+    fread(gba->bios, sizeof(uint8_t), size, fp);
     
     fclose(fp);
 }
 
+// every loaded ROM, looked up by file identity so that the same file under another path is shared too
+static RomImage *rom_images = NULL;
+static pthread_mutex_t rom_images_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// past the end of the cartridge nothing drives the bus, which is left holding the low bits of the
+// (halfword) address the ROM was sent
+#define ROM_OPEN_BUS(offset) ((uint16_t)((offset) >> 1))
+
 void load_rom(char *rom_file) {
-    FILE *fp = fopen(rom_file, "rb");
-    if (fp == NULL) {
+    int fd = open(rom_file, O_RDONLY);
+    struct stat st;
+    if ((fd < 0) || (fstat(fd, &st) != 0)) {
         fprintf(stderr, "ERROR: file (%s) failed to open\n", rom_file);
-        exit(1);
+        if (fd >= 0) close(fd);
+        gba_fatal();
     }
 
-    fseek(fp, 0, SEEK_END);
-    size_t size = ftell(fp);
-    fseek(fp, 0, SEEK_SET);
+    pthread_mutex_lock(&rom_images_lock);
+
+    RomImage *image = rom_images;
+    while ((image != NULL) && ((image->device != st.st_dev) || (image->inode != st.st_ino)))
+        image = image->next;
+
+    if (image == NULL) {
+        size_t size = ((size_t)st.st_size < ROM_REGION_SIZE) ? (size_t)st.st_size : ROM_REGION_SIZE;
+        uint8_t *data = NULL;
+        bool mapped = false;
+
+        // mapped privately so the pages are shared with every other process running the same ROM and
+        // only the ones actually read are ever loaded. the rest of the last page reads as 0, which
+        // covers word reads straddling the end of the file
+        if (size > 0) {
+            data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            mapped = data != MAP_FAILED;
+            if (!mapped && ((data = calloc(1, (size + 3) & ~3)) != NULL)) {
+                ssize_t bytes_read = read(fd, data, size);
+                size = (bytes_read > 0) ? (size_t)bytes_read : 0;
+            }
+        }
 
-    fread(rom, sizeof(uint8_t), size, fp);
-    
-    fclose(fp);
+        image = calloc(1, sizeof(RomImage));
+        if ((image == NULL) || ((size > 0) && (data == NULL))) {
+            pthread_mutex_unlock(&rom_images_lock);
+            close(fd);
+            free(image);
+            fprintf(stderr, "ERROR: failed to allocate memory for %s\n", rom_file);
+            gba_fatal();
+        }
+
+        *image = (RomImage){ st.st_dev, st.st_ino, data, size, mapped, 0, rom_images };
+        rom_images = image;
+    }
+
+    image->refs++;
+    pthread_mutex_unlock(&rom_images_lock);
+    close(fd);
+
+    gba->rom_image = image;
+    gba->rom = image->data;
+    gba->rom_size = image->size;
+}
+
+void retain_rom(RomImage *image) {
+    pthread_mutex_lock(&rom_images_lock);
+    image->refs++;
+    pthread_mutex_unlock(&rom_images_lock);
+}
+
+void release_rom(RomImage *image) {
+    if (image == NULL) return;
+
+    pthread_mutex_lock(&rom_images_lock);
+
+    if (--image->refs == 0) {
+        RomImage **link = &rom_images;
+        while (*link != image)
+            link = &(*link)->next;
+        *link = image->next;
+
+        if (image->mapped) {
+            munmap(image->data, image->size);
+        } else {
+            free(image->data);
+        }
+        free(image);
+    }
+
+    pthread_mutex_unlock(&rom_images_lock);
 }
 
 uint32_t read_word(uint32_t addr) {
     addr &= ~3;
 
     switch ((addr >> 24) & 0xFF) {
-    case 0x00: return *(uint32_t *)(bios + addr);
-    case 0x02: return *(uint32_t *)(external_wram + ((addr - 0x02000000) & 0x3FFFF));
-    case 0x03: return *(uint32_t *)(internal_wram + ((addr - 0x03000000) & 0x7FFF));
+    case 0x00: return *(uint32_t *)(gba->bios + addr);
+    case 0x02: return *(uint32_t *)(gba->external_wram + ((addr - 0x02000000) & 0x3FFFF));
+    case 0x03: return *(uint32_t *)(gba->internal_wram + ((addr - 0x03000000) & 0x7FFF));
     case 0x04:
         switch (addr) {
-        case 0x04000006: return reg_vcount;
-        case 0x04000130: return reg_keyinput;
+        case 0x04000006: return gba->reg_vcount;
+        case 0x04000130: return gba->reg_keyinput;
         default:
-            if (addr >= 0x04000000 && addr <= 0x04000054) return *(uint32_t *)(ppu_mmio + (addr - 0x04000000));
+            if (addr >= 0x04000000 && addr <= 0x04000054) return *(uint32_t *)(gba->ppu_mmio + (addr - 0x04000000));
             printf("[read] unmapped hardware register: %08X\n", addr);
-            exit(1);
+            gba_fatal();
         }
-    case 0x05: return *(uint32_t *)(pallete_ram + ((addr - 0x05000000) & 0x3FF));
+    case 0x05: return *(uint32_t *)(gba->pallete_ram + ((addr - 0x05000000) & 0x3FF));
     case 0x06:
         addr = (addr - 0x06000000) & 0x1FFFF;
         if (addr >= 0x18000 && addr <= 0x1FFFF) {
-            return *(uint32_t *)(vram + (addr - 0x8000));
+            return *(uint32_t *)(gba->vram + (addr - 0x8000));
         } else {
-            return *(uint32_t *)(vram + addr);
+            return *(uint32_t *)(gba->vram + addr);
         }
-    case 0x07: return *(uint32_t *)(oam + ((addr - 0x07000000) & 0x3FF));
+    case 0x07: return *(uint32_t *)(gba->oam + ((addr - 0x07000000) & 0x3FF));
     case 0x08:
     case 0x09:
     case 0x0A:
     case 0x0B:
     case 0x0C:
-    case 0x0D: return *(uint32_t *)(rom + ((addr - 0x08000000) & 0x1FFFFFF));
+    case 0x0D:
+        addr = (addr - 0x08000000) & (ROM_REGION_SIZE - 1);
+        if (addr < gba->rom_size) return *(const uint32_t *)(gba->rom + addr);
+        return ROM_OPEN_BUS(addr) | (ROM_OPEN_BUS(addr + 2) << 16);
     case 0x0E:
         printf("cart ram\n");
-        exit(1);
+        gba_fatal();
     }
 
     return 0;
@@ -85,36 +160,39 @@ uint16_t read_halfword(uint32_t addr) {
     addr &= ~1;
 
     switch ((addr >> 24) & 0xFF) {
-    case 0x00: return *(uint16_t *)(bios + addr);
-    case 0x02: return *(uint16_t *)(external_wram + ((addr - 0x02000000) & 0x3FFFF));
-    case 0x03: return *(uint16_t *)(internal_wram + ((addr - 0x03000000) & 0x7FFF));
+    case 0x00: return *(uint16_t *)(gba->bios + addr);
+    case 0x02: return *(uint16_t *)(gba->external_wram + ((addr - 0x02000000) & 0x3FFFF));
+    case 0x03: return *(uint16_t *)(gba->internal_wram + ((addr - 0x03000000) & 0x7FFF));
     case 0x04:
         switch (addr) {
-        case 0x04000006: return reg_vcount;
-        case 0x04000130: return reg_keyinput;
+        case 0x04000006: return gba->reg_vcount;
+        case 0x04000130: return gba->reg_keyinput;
         default:
-            if (addr >= 0x04000000 && addr <= 0x04000054) return *(uint16_t *)(ppu_mmio + (addr - 0x04000000));
+            if (addr >= 0x04000000 && addr <= 0x04000054) return *(uint16_t *)(gba->ppu_mmio + (addr - 0x04000000));
             printf("[read] unmapped hardware register: %08X\n", addr);
-            exit(1);
+            gba_fatal();
         }
-    case 0x05: return *(uint16_t *)(pallete_ram + ((addr - 0x05000000) & 0x3FF));
+    case 0x05: return *(uint16_t *)(gba->pallete_ram + ((addr - 0x05000000) & 0x3FF));
     case 0x06:
         addr = (addr - 0x06000000) & 0x1FFFF;
         if (addr >= 0x18000 && addr <= 0x1FFFF) {
-            return *(uint16_t *)(vram + (addr - 0x8000));
+            return *(uint16_t *)(gba->vram + (addr - 0x8000));
         } else {
-            return *(uint16_t *)(vram + addr);
+            return *(uint16_t *)(gba->vram + addr);
         }
-    case 0x07: return *(uint16_t *)(oam + ((addr - 0x07000000) & 0x3FF));
+    case 0x07: return *(uint16_t *)(gba->oam + ((addr - 0x07000000) & 0x3FF));
     case 0x08:
     case 0x09:
     case 0x0A:
     case 0x0B:
     case 0x0C:
-    case 0x0D: return *(uint16_t *)(rom + ((addr - 0x08000000) & 0x1FFFFFF));
+    case 0x0D:
+        addr = (addr - 0x08000000) & (ROM_REGION_SIZE - 1);
+        if (addr < gba->rom_size) return *(const uint16_t *)(gba->rom + addr);
+        return ROM_OPEN_BUS(addr);
     case 0x0E:
         printf("cart ram\n");
-        exit(1);
+        gba_fatal();
     }
 
     return 0;
@@ -122,33 +200,36 @@ uint16_t read_halfword(uint32_t addr) {
 
 uint8_t read_byte(uint32_t addr) {
     switch ((addr >> 24) & 0xFF) {
-    case 0x00: return bios[addr];
-    case 0x02: return external_wram[(addr - 0x02000000) & 0x3FFFF];
-    case 0x03: return internal_wram[(addr - 0x03000000) & 0x7FFF];
+    case 0x00: return gba->bios[addr];
+    case 0x02: return gba->external_wram[(addr - 0x02000000) & 0x3FFFF];
+    case 0x03: return gba->internal_wram[(addr - 0x03000000) & 0x7FFF];
     case 0x04:
         switch (addr) {
-        case 0x04000006: return reg_vcount;
-        case 0x04000130: return reg_keyinput;
+        case 0x04000006: return gba->reg_vcount;
+        case 0x04000130: return gba->reg_keyinput;
         default:
-            if (addr >= 0x04000000 && addr <= 0x04000054) return ppu_mmio[addr];
+            if (addr >= 0x04000000 && addr <= 0x04000054) return gba->ppu_mmio[addr - 0x04000000];
             printf("[read] unmapped hardware register: %08X\n", addr);
-            exit(1);
+            gba_fatal();
         }
-    case 0x05: return pallete_ram[(addr - 0x05000000) & 0x3FF];
+    case 0x05: return gba->pallete_ram[(addr - 0x05000000) & 0x3FF];
     case 0x06:
         addr = (addr - 0x06000000) & 0x1FFFF;
         if (addr >= 0x18000) addr -= 0x8000;
-        return vram[addr];
-    case 0x07: return oam[(addr - 0x07000000) & 0x3FF];
+        return gba->vram[addr];
+    case 0x07: return gba->oam[(addr - 0x07000000) & 0x3FF];
     case 0x08:
     case 0x09:
     case 0x0A:
     case 0x0B:
     case 0x0C:
-    case 0x0D: return rom[(addr - 0x08000000) & 0x1FFFFFF];
+    case 0x0D:
+        addr = (addr - 0x08000000) & (ROM_REGION_SIZE - 1);
+        if (addr < gba->rom_size) return gba->rom[addr];
+        return ROM_OPEN_BUS(addr) >> ((addr & 1) * 8);
     case 0x0E:
         printf("cart ram\n");
-        exit(1); 
+        gba_fatal(); 
     }
 
     return 0;
@@ -168,50 +249,71 @@ void write_word(uint32_t addr, uint32_t word) {
 
     illegal_write: return;
 
-    external_wram_reg:
-        *(uint32_t *)(external_wram + ((addr - 0x02000000) & 0x3FFFF)) = word;
+    external_wram_reg: {
+        uint8_t *dst = gba->external_wram + ((addr - 0x02000000) & 0x3FFFF);
+        *(uint32_t *)dst = word;
+        MARK_STATE_WRITTEN(dst);
         return;
+    }
     
-    internal_wram_reg:
-        *(uint32_t *)(internal_wram + ((addr - 0x03000000) & 0x7FFF)) = word;
+    internal_wram_reg: {
+        uint8_t *dst = gba->internal_wram + ((addr - 0x03000000) & 0x7FFF);
+        *(uint32_t *)dst = word;
+        MARK_STATE_WRITTEN(dst);
         return;
+    }
 
     mapped_registers:
+        if (addr <= 0x04000054) {
+            CATCH_UP_PPU();
+            gba->ppu_state_written = true;
+        }
+
         switch (addr) {
         case 0x04000000:
-            *(uint32_t *)ppu_mmio = word;
-            uint8_t mode = (*ppu_mmio >> 8) & 0x1F;
-            is_rendering_bitmap = mode == 3 | mode == 4 | mode == 5;
+            *(uint32_t *)gba->ppu_mmio = word;
+            uint8_t mode = *(uint16_t *)gba->ppu_mmio & 0x7;
+            gba->is_rendering_bitmap = (mode >= 3) && (mode <= 5);
             return;
         case 0x04000208:
-            reg_ime = word;
+            gba->reg_ime = word;
             return;
         default:
             if (addr >= 0x04000000 && addr <= 0x04000054) {
-                *(uint32_t *)(ppu_mmio + (addr - 0x04000000)) = word;
+                *(uint32_t *)(gba->ppu_mmio + (addr - 0x04000000)) = word;
+                reload_bg_ref_point(addr - 0x04000000);
             } else {
                 printf("[write] unmapped hardware register: %08X\n", addr);
-                exit(1);
+                gba_fatal();
             }
         }
+        return;
 
     pallete_ram_reg:
-        *(uint32_t *)(pallete_ram + ((addr - 0x05000000) & 0x3FF)) = word;
+        CATCH_UP_PPU();
+        gba->ppu_state_written = true;
+        *(uint32_t *)(gba->pallete_ram + ((addr - 0x05000000) & 0x3FF)) = word;
+        MARK_PALLETE_DIRTY((addr - 0x05000000) & 0x3FF);
         return;
 
     vram_reg:
+        CATCH_UP_PPU();
+        gba->ppu_state_written = true;
         addr = (addr - 0x06000000) & 0x1FFFF;
         if (addr >= 0x18000) addr -= 0x8000;
-        *(uint32_t *)(vram + addr) = word;
+        *(uint32_t *)(gba->vram + addr) = word;
+        MARK_VRAM_DIRTY(addr);
+        MARK_STATE_WRITTEN(gba->vram + addr);
         return;
 
     oam_reg:
-        *(uint32_t *)(oam + ((addr - 0x07000000) & 0x3FF)) = word;
+        gba->ppu_state_written = true;
+        *(uint32_t *)(gba->oam + ((addr - 0x07000000) & 0x3FF)) = word;
         return;
     
     cart_ram_reg:
         printf("cart ram write unhandled\n");
-        exit(1);
+        gba_fatal();
 }
 
 void write_halfword(uint32_t addr, uint16_t halfword) {
@@ -228,51 +330,72 @@ void write_halfword(uint32_t addr, uint16_t halfword) {
 
     illegal_write: return;
 
-    external_wram_reg:
-        *(uint16_t *)(external_wram + ((addr - 0x02000000) & 0x3FFFF)) = halfword;
+    external_wram_reg: {
+        uint8_t *dst = gba->external_wram + ((addr - 0x02000000) & 0x3FFFF);
+        *(uint16_t *)dst = halfword;
+        MARK_STATE_WRITTEN(dst);
         return;
+    }
     
-    internal_wram_reg:
-        *(uint16_t *)(internal_wram + ((addr - 0x03000000) & 0x7FFF)) = halfword;
+    internal_wram_reg: {
+        uint8_t *dst = gba->internal_wram + ((addr - 0x03000000) & 0x7FFF);
+        *(uint16_t *)dst = halfword;
+        MARK_STATE_WRITTEN(dst);
         return;
+    }
 
     mapped_registers:
+        if (addr <= 0x04000054) {
+            CATCH_UP_PPU();
+            gba->ppu_state_written = true;
+        }
+
         switch (addr) {
         case 0x04000000: {
-            *(uint16_t *)ppu_mmio = halfword;
-            uint8_t mode = (*ppu_mmio >> 8) & 0x1F;
-            is_rendering_bitmap = mode == 3 | mode == 4 | mode == 5;
+            *(uint16_t *)gba->ppu_mmio = halfword;
+            uint8_t mode = *(uint16_t *)gba->ppu_mmio & 0x7;
+            gba->is_rendering_bitmap = (mode >= 3) && (mode <= 5);
             return;
         }
         case 0x04000208:
-            reg_ime = halfword;
+            gba->reg_ime = halfword;
             return;
         default:
             if (addr >= 0x04000000 && addr <= 0x04000054) {
-                *(uint16_t *)(ppu_mmio + (addr - 0x04000000)) = halfword;
+                *(uint16_t *)(gba->ppu_mmio + (addr - 0x04000000)) = halfword;
+                reload_bg_ref_point(addr - 0x04000000);
             } else {
                 printf("[write] unmapped hardware register: %08X\n", addr);
-                exit(1);
+                gba_fatal();
             }
         }
+        return;
 
     pallete_ram_reg:
-        *(uint16_t *)(pallete_ram + ((addr - 0x05000000) & 0x3FF)) = halfword;
+        CATCH_UP_PPU();
+        gba->ppu_state_written = true;
+        *(uint16_t *)(gba->pallete_ram + ((addr - 0x05000000) & 0x3FF)) = halfword;
+        MARK_PALLETE_DIRTY((addr - 0x05000000) & 0x3FF);
         return;
 
     vram_reg:
+        CATCH_UP_PPU();
+        gba->ppu_state_written = true;
         addr = (addr - 0x06000000) & 0x1FFFF;
         if (addr >= 0x18000) addr -= 0x8000;
-        *(uint16_t *)(vram + addr) = halfword;
+        *(uint16_t *)(gba->vram + addr) = halfword;
+        MARK_VRAM_DIRTY(addr);
+        MARK_STATE_WRITTEN(gba->vram + addr);
         return;
 
     oam_reg:
-        *(uint16_t *)(oam + ((addr - 0x07000000) & 0x3FF)) = halfword;
+        gba->ppu_state_written = true;
+        *(uint16_t *)(gba->oam + ((addr - 0x07000000) & 0x3FF)) = halfword;
         return;
     
     cart_ram_reg:
         printf("cart ram write unhandled\n");
-        exit(1);
+        gba_fatal();
 }
 
 void write_byte(uint32_t addr, uint8_t byte) {
@@ -287,37 +410,54 @@ void write_byte(uint32_t addr, uint8_t byte) {
 
     illegal_write: return;
 
-    external_wram_reg:
-        external_wram[(addr - 0x02000000) & 0x3FFFF] = byte;
+    external_wram_reg: {
+        uint8_t *dst = gba->external_wram + ((addr - 0x02000000) & 0x3FFFF);
+        *dst = byte;
+        MARK_STATE_WRITTEN(dst);
         return;
+    }
     
-    internal_wram_reg:
-        internal_wram[(addr - 0x03000000) & 0x7FFF] = byte;
+    internal_wram_reg: {
+        uint8_t *dst = gba->internal_wram + ((addr - 0x03000000) & 0x7FFF);
+        *dst = byte;
+        MARK_STATE_WRITTEN(dst);
         return;
+    }
 
     mapped_registers:
+        if (addr <= 0x04000054) {
+            CATCH_UP_PPU();
+            gba->ppu_state_written = true;
+        }
+
         switch (addr) {
         case 0x04000208:
-            reg_ime = byte;
+            gba->reg_ime = byte;
             break;
         default:
             if (addr >= 0x04000000 && addr <= 0x04000054) {
-                *(ppu_mmio + (addr - 0x04000000)) = byte;
+                *(gba->ppu_mmio + (addr - 0x04000000)) = byte;
+                reload_bg_ref_point(addr - 0x04000000);
             } else {
                 printf("[write] unmapped hardware register: %08X\n", addr);
-                exit(1);
+                gba_fatal();
             }
         }
         return;
 
     // byte writes to pallete ram are ignored
     pallete_ram_reg: {
+        CATCH_UP_PPU();
+        gba->ppu_state_written = true;
         uint16_t duplicated_halfword = (byte << 8) | byte;
-        *(uint16_t *)(pallete_ram + (((addr - 0x05000000) & 0x3FF) & ~1)) = duplicated_halfword;
+        *(uint16_t *)(gba->pallete_ram + (((addr - 0x05000000) & 0x3FF) & ~1)) = duplicated_halfword;
+        MARK_PALLETE_DIRTY((addr - 0x05000000) & 0x3FF);
         return;
     }
 
     vram_reg: {
+        CATCH_UP_PPU();
+        gba->ppu_state_written = true;
         addr = (addr - 0x06000000) & 0x1FFFF;
         if (addr >= 0x18000) addr -= 0x8000;
 
@@ -325,12 +465,14 @@ void write_byte(uint32_t addr, uint8_t byte) {
         if (addr >= 0x14000) return;
 
         uint32_t bg_vram_size = 0x10000;
-        if (is_rendering_bitmap) bg_vram_size = 0x14000;
+        if (gba->is_rendering_bitmap) bg_vram_size = 0x14000;
 
         // byte writes to bg vram are duplicated across the halfword
         if (addr < bg_vram_size) {
             uint16_t duplicated_halfword = (byte << 8) | byte;
-            *(uint16_t *)(vram + (addr & ~1)) = duplicated_halfword;
+            *(uint16_t *)(gba->vram + (addr & ~1)) = duplicated_halfword;
+            MARK_VRAM_DIRTY(addr);
+            MARK_STATE_WRITTEN(gba->vram + addr);
         }
         return;
     }
@@ -340,5 +482,5 @@ void write_byte(uint32_t addr, uint8_t byte) {
 
     cart_ram_reg:
         printf("cart ram write unhandled\n");
-        exit(1);
+        gba_fatal();
 }
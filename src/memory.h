@@ -1,18 +1,28 @@
 #ifndef MEMORY_H
 #define MEMORY_H
 
-#include "ppu.h"
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <sys/types.h>
 
-extern uint8_t bios[0x4000];
-extern uint8_t external_wram[0x40000];
-extern uint8_t internal_wram[0x8000];
-extern uint8_t rom[0x2000000];
+#define ROM_REGION_SIZE 0x2000000
 
-extern uint16_t reg_ime;
-extern uint16_t reg_keyinput;
+// a ROM loaded into memory, shared read-only by every instance running the same file
+typedef struct RomImage {
+    dev_t device;
+    ino_t inode;
+    uint8_t *data; // mapped from the file, or read into a buffer of its size where it can't be mapped
+    size_t size; // clamped to ROM_REGION_SIZE
+    bool mapped;
+    int refs;
+    struct RomImage *next;
+} RomImage;
 
 void load_bios(char *bios_file);
 void load_rom(char *rom_file);
+void retain_rom(RomImage *image);
+void release_rom(RomImage *image);
 
 uint32_t read_word(uint32_t addr);
 uint16_t read_halfword(uint32_t addr);
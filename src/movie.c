@@ -0,0 +1,140 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "movie.h"
+#include "hash.h"
+
+#define MAX_RUN_FRAMES 0xFFFF
+
+Movie *movie_create(GBA *instance, bool from_power_on) {
+    Movie *movie = calloc(1, sizeof(Movie));
+    if (movie == NULL) {
+        fprintf(stderr, "ERROR: failed to allocate the movie\n");
+        exit(1);
+    }
+
+    movie->rom_hash = hash_rom(instance);
+    if (!from_power_on) {
+        movie->start_state = malloc(SAVESTATE_SIZE);
+        if (movie->start_state == NULL) {
+            fprintf(stderr, "ERROR: failed to allocate the movie\n");
+            exit(1);
+        }
+        gba_save_state(instance, movie->start_state);
+    }
+
+    return movie;
+}
+
+void movie_record_frame(Movie *movie, uint16_t keys) {
+    if (movie->num_frames == movie->capacity) {
+        movie->capacity = movie->capacity ? movie->capacity * 2 : 4096;
+        movie->keys = realloc(movie->keys, movie->capacity * sizeof(uint16_t));
+        if (movie->keys == NULL) {
+            fprintf(stderr, "ERROR: failed to allocate the movie\n");
+            exit(1);
+        }
+    }
+
+    movie->keys[movie->num_frames++] = keys;
+}
+
+void movie_save(const Movie *movie, const char *movie_file) {
+    FILE *fp = fopen(movie_file, "wb");
+    if (fp == NULL) {
+        fprintf(stderr, "ERROR: failed to create %s\n", movie_file);
+        exit(1);
+    }
+
+    MovieHeader header = { MOVIE_MAGIC, MOVIE_VERSION, movie->rom_hash, movie->num_frames, movie->start_state ? SAVESTATE_SIZE : 0 };
+    fwrite(&header, sizeof(header), 1, fp);
+    if (movie->start_state != NULL)
+        fwrite(movie->start_state, 1, SAVESTATE_SIZE, fp);
+
+    for (int frame = 0; frame < movie->num_frames; ) {
+        MovieRun run = { movie->keys[frame], 0 };
+        while ((frame < movie->num_frames) && (movie->keys[frame] == run.keys) && (run.frames < MAX_RUN_FRAMES)) {
+            run.frames++;
+            frame++;
+        }
+        fwrite(&run, sizeof(run), 1, fp);
+    }
+
+    if (fclose(fp) != 0) {
+        fprintf(stderr, "ERROR: failed to write %s\n", movie_file);
+        exit(1);
+    }
+}
+
+static void bad_movie(FILE *fp, const char *movie_file) {
+    fclose(fp);
+    fprintf(stderr, "ERROR: %s isn't a movie from this version\n", movie_file);
+    exit(1);
+}
+
+Movie *movie_load(const char *movie_file) {
+    FILE *fp = fopen(movie_file, "rb");
+    if (fp == NULL) {
+        fprintf(stderr, "ERROR: failed to open movie %s\n", movie_file);
+        exit(1);
+    }
+
+    MovieHeader header;
+    if ((fread(&header, sizeof(header), 1, fp) != 1) || (header.magic != MOVIE_MAGIC) || (header.version != MOVIE_VERSION) ||
+        ((header.start_state_size != 0) && (header.start_state_size != SAVESTATE_SIZE)) || (header.num_frames > INT32_MAX))
+        bad_movie(fp, movie_file);
+
+    Movie *movie = calloc(1, sizeof(Movie));
+    if (movie == NULL) {
+        fprintf(stderr, "ERROR: failed to allocate the movie\n");
+        exit(1);
+    }
+
+    movie->rom_hash = header.rom_hash;
+    movie->capacity = header.num_frames;
+    movie->keys = malloc((header.num_frames + 1) * sizeof(uint16_t));
+    if (header.start_state_size != 0)
+        movie->start_state = malloc(SAVESTATE_SIZE);
+
+    if ((movie->keys == NULL) || ((header.start_state_size != 0) && (movie->start_state == NULL))) {
+        fprintf(stderr, "ERROR: failed to allocate the movie\n");
+        exit(1);
+    }
+
+    if ((movie->start_state != NULL) && (fread(movie->start_state, 1, SAVESTATE_SIZE, fp) != SAVESTATE_SIZE))
+        bad_movie(fp, movie_file);
+
+    MovieRun run;
+    while (movie->num_frames < (int)header.num_frames) {
+        if ((fread(&run, sizeof(run), 1, fp) != 1) || (run.frames == 0) || (run.frames > header.num_frames - movie->num_frames))
+            bad_movie(fp, movie_file);
+
+        for (int i = 0; i < run.frames; i++)
+            movie->keys[movie->num_frames++] = run.keys;
+    }
+
+    fclose(fp);
+    return movie;
+}
+
+void movie_start(const Movie *movie, GBA *instance) {
+    if (hash_rom(instance) != movie->rom_hash) {
+        fprintf(stderr, "ERROR: the movie was recorded with a different ROM\n");
+        gba_fatal();
+    }
+
+    if (movie->start_state != NULL) {
+        if (!gba_load_state(instance, movie->start_state, SAVESTATE_SIZE)) {
+            fprintf(stderr, "ERROR: the movie's start state isn't from this version\n");
+            gba_fatal();
+        }
+    } else {
+        gba_reset(instance);
+    }
+}
+
+void movie_destroy(Movie *movie) {
+    free(movie->start_state);
+    free(movie->keys);
+    free(movie);
+}
@@ -0,0 +1,45 @@
+#ifndef MOVIE_H
+#define MOVIE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "gba.h"
+
+// an input movie: the keys of every frame run, from power on or from a savestate. the file is a
+// MovieHeader, the start state if there is one, then runs of frames with the same keys held
+#define MOVIE_MAGIC   0x4D414247 // "GBAM"
+#define MOVIE_VERSION 1
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t rom_hash;
+    uint32_t num_frames;
+    uint32_t start_state_size; // SAVESTATE_SIZE, or 0 to start from power on
+} MovieHeader;
+
+typedef struct {
+    uint16_t keys;
+    uint16_t frames;
+} MovieRun;
+
+typedef struct {
+    uint64_t rom_hash;
+    uint8_t *start_state; // NULL from power on
+    uint16_t *keys; // one per frame, active low like KEYINPUT
+    int num_frames;
+    int capacity;
+} Movie;
+
+// starts recording from the instance's current state, or from power on (which it has to be in)
+Movie *movie_create(GBA *instance, bool from_power_on);
+void movie_record_frame(Movie *movie, uint16_t keys);
+void movie_save(const Movie *movie, const char *movie_file);
+
+Movie *movie_load(const char *movie_file);
+// puts the instance into the state the movie starts from. the ROM has to be the one it was recorded with
+void movie_start(const Movie *movie, GBA *instance);
+
+void movie_destroy(Movie *movie);
+
+#endif
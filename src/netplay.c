@@ -0,0 +1,237 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include "netplay.h"
+#include "hash.h"
+
+// input is sent again this often while the remote side might be missing some, in case it was lost
+#define RESEND_INTERVAL (1.0 / 60.0)
+
+Netplay *netplay_create(GBA *instance, int local_port) {
+    Netplay *netplay = calloc(1, sizeof(Netplay));
+    if (netplay == NULL) {
+        fprintf(stderr, "ERROR: failed to allocate the netplay session\n");
+        exit(1);
+    }
+
+    for (int i = 0; i < NETPLAY_MAX_ROLLBACK; i++) {
+        if ((netplay->states[i] = malloc(SAVESTATE_SIZE)) == NULL) {
+            fprintf(stderr, "ERROR: failed to allocate the netplay session\n");
+            exit(1);
+        }
+    }
+
+    netplay->socket = socket(AF_INET, SOCK_DGRAM, 0);
+    struct sockaddr_in address = { .sin_family = AF_INET, .sin_port = htons(local_port), .sin_addr.s_addr = htonl(INADDR_ANY) };
+    if ((netplay->socket < 0) || (bind(netplay->socket, (struct sockaddr *)&address, sizeof(address)) != 0)) {
+        fprintf(stderr, "ERROR: failed to open UDP port %d\n", local_port);
+        exit(1);
+    }
+    fcntl(netplay->socket, F_SETFL, fcntl(netplay->socket, F_GETFL) | O_NONBLOCK);
+
+    netplay->instance = instance;
+    netplay->rom_check = (uint32_t)hash_rom(instance);
+    netplay->jitter_seed = (unsigned int)local_port;
+
+    return netplay;
+}
+
+int netplay_local_port(const Netplay *netplay) {
+    struct sockaddr_in address;
+    socklen_t size = sizeof(address);
+    getsockname(netplay->socket, (struct sockaddr *)&address, &size);
+    return ntohs(address.sin_port);
+}
+
+void netplay_connect(Netplay *netplay, const char *host, int port) {
+    char service[16];
+    snprintf(service, sizeof(service), "%d", port);
+
+    struct addrinfo hints = { .ai_family = AF_INET, .ai_socktype = SOCK_DGRAM };
+    struct addrinfo *addresses;
+    if ((getaddrinfo(host, service, &hints, &addresses) != 0) || (connect(netplay->socket, addresses->ai_addr, addresses->ai_addrlen) != 0)) {
+        fprintf(stderr, "ERROR: failed to connect to %s:%d\n", host, port);
+        exit(1);
+    }
+    freeaddrinfo(addresses);
+}
+
+void netplay_simulate_delay(Netplay *netplay, int latency_ms, int jitter_ms) {
+    netplay->latency = latency_ms / 1000.0;
+    netplay->jitter = jitter_ms / 1000.0;
+}
+
+void netplay_destroy(Netplay *netplay) {
+    close(netplay->socket);
+    for (int i = 0; i < NETPLAY_MAX_ROLLBACK; i++)
+        free(netplay->states[i]);
+    free(netplay->delayed);
+    free(netplay);
+}
+
+// the remote side is expected to keep holding what it last held
+static uint16_t remote_keys_for(const Netplay *netplay, int frame) {
+    if (frame < netplay->remote_frames)
+        return netplay->remote_keys[frame % NETPLAY_INPUT_HISTORY];
+    if (netplay->remote_frames > 0)
+        return netplay->remote_keys[(netplay->remote_frames - 1) % NETPLAY_INPUT_HISTORY];
+    return 0xFFFF;
+}
+
+// keys are active low, so a key is down if either player holds it
+static uint16_t *run_frame(Netplay *netplay, int frame) {
+    uint16_t remote_keys = remote_keys_for(netplay, frame);
+    netplay->used_remote_keys[frame % NETPLAY_INPUT_HISTORY] = remote_keys;
+
+    // only frames that may still be rolled back to need their state kept
+    if (frame >= netplay->remote_frames)
+        gba_save_state(netplay->instance, netplay->states[frame % NETPLAY_MAX_ROLLBACK]);
+
+    return gba_run_frame(netplay->instance, netplay->local_keys[frame % NETPLAY_INPUT_HISTORY] & remote_keys);
+}
+
+static void send_packet(Netplay *netplay, const NetplayPacket *packet) {
+    size_t size = offsetof(NetplayPacket, keys) + (packet->num_keys * sizeof(uint16_t));
+
+    // the remote side may not be there yet, anything lost is sent again
+    send(netplay->socket, packet, size, 0);
+}
+
+static void send_input(Netplay *netplay) {
+    NetplayPacket packet = { NETPLAY_MAGIC, netplay->rom_check, netplay->remote_frames, netplay->acked_frames, 0, {0} };
+    for (int frame = netplay->acked_frames; (frame < netplay->frame) && (packet.num_keys < NETPLAY_MAX_PACKET_KEYS); frame++)
+        packet.keys[packet.num_keys++] = netplay->local_keys[frame % NETPLAY_INPUT_HISTORY];
+
+    netplay->last_send = gba_now_seconds();
+    netplay->ack_owed = false;
+    if ((netplay->latency == 0) && (netplay->jitter == 0)) {
+        send_packet(netplay, &packet);
+        return;
+    }
+
+    if (netplay->num_delayed == netplay->max_delayed) {
+        netplay->max_delayed = netplay->max_delayed ? netplay->max_delayed * 2 : 64;
+        netplay->delayed = realloc(netplay->delayed, netplay->max_delayed * sizeof(DelayedPacket));
+        if (netplay->delayed == NULL) {
+            fprintf(stderr, "ERROR: failed to allocate the netplay session\n");
+            exit(1);
+        }
+    }
+
+    double jitter = netplay->jitter * rand_r(&netplay->jitter_seed) / RAND_MAX;
+    netplay->delayed[netplay->num_delayed++] = (DelayedPacket){ netplay->last_send + netplay->latency + jitter, packet };
+}
+
+// with jitter, packets can go out in a different order than they were sent in
+static void send_delayed(Netplay *netplay) {
+    double now = gba_now_seconds();
+
+    for (int i = 0; i < netplay->num_delayed; ) {
+        if (netplay->delayed[i].due <= now) {
+            send_packet(netplay, &netplay->delayed[i].packet);
+            netplay->delayed[i] = netplay->delayed[--netplay->num_delayed];
+        } else {
+            i++;
+        }
+    }
+}
+
+static void receive_input(Netplay *netplay) {
+    NetplayPacket packet;
+    ssize_t size;
+
+    while ((size = recv(netplay->socket, &packet, sizeof(packet), 0)) >= 0) {
+        if ((size < (ssize_t)offsetof(NetplayPacket, keys)) || (packet.magic != NETPLAY_MAGIC) ||
+            (packet.num_keys > NETPLAY_MAX_PACKET_KEYS) || (size < (ssize_t)(offsetof(NetplayPacket, keys) + (packet.num_keys * sizeof(uint16_t)))))
+            continue;
+
+        if (packet.rom_check != netplay->rom_check) {
+            fprintf(stderr, "ERROR: the other side of the netplay session is running a different ROM\n");
+            exit(1);
+        }
+
+        if ((int)packet.ack > netplay->acked_frames)
+            netplay->acked_frames = packet.ack;
+
+        // the remote side keeps sending input until it hears it arrived
+        if (packet.num_keys > 0)
+            netplay->ack_owed = true;
+
+        // only the keys following on from the ones already received are taken
+        for (uint32_t i = 0; i < packet.num_keys; i++) {
+            int frame = packet.first_frame + i;
+            if (frame == netplay->remote_frames) {
+                netplay->remote_keys[frame % NETPLAY_INPUT_HISTORY] = packet.keys[i];
+                netplay->remote_frames++;
+            }
+        }
+    }
+}
+
+// loads the state from before the first wrong frame and runs everything since again. it's only the
+// CPU being emulated: nothing is drawn until the frame after the last one run again, and only the
+// states of frames whose remote input still isn't known are saved
+static void roll_back(Netplay *netplay, int first_wrong_frame) {
+    double start = gba_now_seconds();
+
+    gba_load_state(netplay->instance, netplay->states[first_wrong_frame % NETPLAY_MAX_ROLLBACK], SAVESTATE_SIZE);
+    pause_rendering(true);
+
+    for (int frame = first_wrong_frame; frame < netplay->frame; frame++) {
+        if (frame == netplay->frame - 1)
+            pause_rendering(false);
+        run_frame(netplay, frame);
+    }
+
+    int frames = netplay->frame - first_wrong_frame;
+    netplay->stats.rollbacks++;
+    netplay->stats.frames_resimulated += frames;
+    netplay->stats.resimulation_seconds += gba_now_seconds() - start;
+    if (frames > netplay->stats.longest_rollback)
+        netplay->stats.longest_rollback = frames;
+}
+
+bool netplay_poll(Netplay *netplay) {
+    receive_input(netplay);
+
+    int known_frames = (netplay->remote_frames < netplay->frame) ? netplay->remote_frames : netplay->frame;
+    for (int frame = netplay->checked_frames; frame < known_frames; frame++) {
+        if (netplay->used_remote_keys[frame % NETPLAY_INPUT_HISTORY] != netplay->remote_keys[frame % NETPLAY_INPUT_HISTORY]) {
+            roll_back(netplay, frame);
+            break;
+        }
+    }
+    netplay->checked_frames = known_frames;
+
+    bool remote_missing_input = (netplay->acked_frames < netplay->frame) || netplay->ack_owed;
+    if (remote_missing_input && (gba_now_seconds() - netplay->last_send >= RESEND_INTERVAL))
+        send_input(netplay);
+    send_delayed(netplay);
+
+    return (netplay->checked_frames == netplay->frame) && (netplay->remote_frames == netplay->frame) &&
+        (netplay->acked_frames == netplay->frame) && (netplay->num_delayed == 0);
+}
+
+uint16_t *netplay_run_frame(Netplay *netplay, uint16_t local_keys) {
+    netplay_poll(netplay);
+
+    // the state to roll back to would be gone
+    if (netplay->frame - netplay->remote_frames >= NETPLAY_MAX_ROLLBACK) {
+        netplay->stats.stalls++;
+        return NULL;
+    }
+
+    netplay->local_keys[netplay->frame % NETPLAY_INPUT_HISTORY] = local_keys;
+    uint16_t *frame = run_frame(netplay, netplay->frame);
+    netplay->frame++;
+
+    send_input(netplay);
+    send_delayed(netplay);
+
+    return frame;
+}
@@ -0,0 +1,90 @@
+#ifndef NETPLAY_H
+#define NETPLAY_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "gba.h"
+
+// how many frames the local side can run past the last one it has the remote side's input for. a
+// savestate is kept for each of them to roll back to
+#define NETPLAY_MAX_ROLLBACK 16
+// the local side can't get more than twice that ahead of what the remote side has acknowledged
+#define NETPLAY_MAX_PACKET_KEYS (2 * NETPLAY_MAX_ROLLBACK)
+#define NETPLAY_INPUT_HISTORY   (4 * NETPLAY_MAX_ROLLBACK)
+
+#define NETPLAY_MAGIC 0x4E414247 // "GBAN"
+
+// every packet carries all the sender's input the receiver hasn't acknowledged yet, so a lost or
+// reordered packet is made up for by the next one
+typedef struct {
+    uint32_t magic;
+    uint32_t rom_check;   // low bits of the ROM hash, so sessions running different ROMs don't mix
+    uint32_t ack;         // frames of the receiver's input the sender has
+    uint32_t first_frame; // frame of keys[0]
+    uint32_t num_keys;
+    uint16_t keys[NETPLAY_MAX_PACKET_KEYS];
+} NetplayPacket;
+
+// a packet held back to simulate latency
+typedef struct {
+    double due;
+    NetplayPacket packet;
+} DelayedPacket;
+
+typedef struct {
+    int rollbacks;
+    int longest_rollback;
+    int frames_resimulated;
+    double resimulation_seconds;
+    int stalls; // calls that couldn't run a frame since the remote side was too far behind
+} NetplayStats;
+
+// rollback netplay over UDP. the core has no link port, so both players drive the same machine: each
+// side runs its own instance with the keys held by either player. the remote player's keys are
+// predicted to stay as they last were, and once they turn out otherwise the state before the first
+// wrong frame is loaded and everything since is run again, undrawn
+typedef struct {
+    GBA *instance;
+    int socket;
+    uint32_t rom_check;
+
+    int frame;          // frames run so far
+    int remote_frames;  // frames the remote side's input was received for, all in order
+    int checked_frames; // frames known to have been run with the remote side's actual input
+    int acked_frames;   // frames of local input the remote side has
+    bool ack_owed;      // input was received since the last packet sent
+
+    uint16_t local_keys[NETPLAY_INPUT_HISTORY];
+    uint16_t remote_keys[NETPLAY_INPUT_HISTORY];
+    uint16_t used_remote_keys[NETPLAY_INPUT_HISTORY]; // predicted or not, what each frame was run with
+    uint8_t *states[NETPLAY_MAX_ROLLBACK]; // before each frame the remote input isn't known for yet
+
+    double latency; // seconds
+    double jitter;
+    unsigned int jitter_seed;
+    DelayedPacket *delayed;
+    int num_delayed;
+    int max_delayed;
+    double last_send;
+
+    NetplayStats stats;
+} Netplay;
+
+// binds to local_port (0 for any free one) on every interface
+Netplay *netplay_create(GBA *instance, int local_port);
+int netplay_local_port(const Netplay *netplay);
+void netplay_connect(Netplay *netplay, const char *host, int port);
+// holds every packet sent back for latency plus up to jitter milliseconds
+void netplay_simulate_delay(Netplay *netplay, int latency_ms, int jitter_ms);
+
+// runs the next frame with the local keys and returns it, or returns NULL without running anything
+// while the remote side is too far behind. mispredicted frames are rolled back and run again first
+uint16_t *netplay_run_frame(Netplay *netplay, uint16_t local_keys);
+
+// exchanges input and rolls back as needed without running a frame. returns whether both sides have
+// each other's input for every frame run so far
+bool netplay_poll(Netplay *netplay);
+
+void netplay_destroy(Netplay *netplay);
+
+#endif
@@ -1,9 +1,19 @@
 #include <stdio.h>
 #include <stdlib.h>
-#include "ppu.h"
+#include <stddef.h>
+#include <string.h>
+#include <sched.h>
+#include <pthread.h>
+#include "gba.h"
 
-#define FRAME_WIDTH  240
-#define FRAME_HEIGHT 160
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_GATHER
+#endif
+
+// mode 5 trades resolution for a second full color page
+#define MODE5_WIDTH  160
+#define MODE5_HEIGHT 128
 
 #define DCNT_MODE    (REG_DISPCNT & 0x7)
 #define DCNT_GB      ((REG_DISPCNT >> 3) & 1)
@@ -17,242 +27,1132 @@
 #define DCNT_BG2 ((REG_DISPCNT >> 0xA) & 1)
 #define DCNT_BG3 ((REG_DISPCNT >> 0xB) & 1)
 #define DCNT_OBJ ((REG_DISPCNT >> 0xC) & 1)
+#define DCNT_WIN0   ((REG_DISPCNT >> 0xD) & 1)
+#define DCNT_WIN1   ((REG_DISPCNT >> 0xE) & 1)
+#define DCNT_WINOBJ ((REG_DISPCNT >> 0xF) & 1)
 
 #define BGCNT_PRIO(bgcnt) (bgcnt & 0x3)
+#define BGCNT_MOSAIC(bgcnt) ((bgcnt >> 0x6) & 1)
+
+#define MOSAIC_BG_H ((REG_MOSAIC & 0xF) + 1)
+#define MOSAIC_BG_V (((REG_MOSAIC >> 4) & 0xF) + 1)
+
+#define BLDCNT_EFFECT ((REG_BLDCNT >> 6) & 0x3)
+
+// BLDCNT effects
+#define EFFECT_NONE    0
+#define EFFECT_ALPHA   1
+#define EFFECT_BRIGHTEN 2
+#define EFFECT_DARKEN  3
+
+// layer ids, matching the bit order of the BLDCNT targets and the WININ/WINOUT enables.
+// for the window registers bit 5 enables color special effects instead of the backdrop
+#define LAYER_OBJ 4
+#define LAYER_BD  5
+#define WINDOW_FX 5
+#define NUM_LAYERS 6
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+// BG2X/Y and BG3X/Y are 28-bit signed 19.8 fixed point values
+#define AFFINE_REF(reg) (((int32_t)((reg) << 4)) >> 4)
+
+// the renderer reads registers through the view it is rendering from, while the
+// DISPSTAT and affine parameter/reference registers below always refer to the live registers
+#define REG_DISPCNT *(uint16_t *)view->mmio
+#define REG_DISPSTAT *(uint16_t *)(gba->ppu_mmio + 0x04)
+
+#define REG_BG0CNT *(uint16_t *)(view->mmio + 0x08)
+#define REG_BG1CNT *(uint16_t *)(view->mmio + 0x0A)
+#define REG_BG2CNT *(uint16_t *)(view->mmio + 0x0C)
+#define REG_BG3CNT *(uint16_t *)(view->mmio + 0x0E)
+#define REG_BGCNT(n) *(uint16_t *)(view->mmio + 0x08 + ((n) * 2))
 
-#define REG_DISPCNT *(uint16_t *)ppu_mmio
-#define REG_DISPSTAT *(uint16_t *)(ppu_mmio + 0x04)
-
-#define REG_BG0CNT *(uint16_t *)(ppu_mmio + 0x08)
-#define REG_BG1CNT *(uint16_t *)(ppu_mmio + 0x0A)
-#define REG_BG2CNT *(uint16_t *)(ppu_mmio + 0x0C)
-#define REG_BG3CNT *(uint16_t *)(ppu_mmio + 0x0E)
-
-#define REG_BG0HOFS *(uint16_t *)(ppu_mmio + 0x10)
-#define REG_BG0VOFS *(uint16_t *)(ppu_mmio + 0x12)
-#define REG_BG1HOFS *(uint16_t *)(ppu_mmio + 0x14)
-#define REG_BG1VOFS *(uint16_t *)(ppu_mmio + 0x16)
-#define REG_BG2HOFS *(uint16_t *)(ppu_mmio + 0x18)
-#define REG_BG2VOFS *(uint16_t *)(ppu_mmio + 0x1A)
-#define REG_BG3HOFS *(uint16_t *)(ppu_mmio + 0x1C)
-#define REG_BG3VOFS *(uint16_t *)(ppu_mmio + 0x1E)
-
-#define REG_BG2PA *(uint16_t *)(ppu_mmio + 0x20)
-#define REG_BG3PA *(uint16_t *)(ppu_mmio + 0x30)
-#define REG_BG2PB *(uint16_t *)(ppu_mmio + 0x22)
-#define REG_BG3PB *(uint16_t *)(ppu_mmio + 0x32)
-#define REG_BG2PC *(uint16_t *)(ppu_mmio + 0x24)
-#define REG_BG3PC *(uint16_t *)(ppu_mmio + 0x34)
-#define REG_BG2PD *(uint16_t *)(ppu_mmio + 0x26)
-#define REG_BG3PD *(uint16_t *)(ppu_mmio + 0x36)
-#define REG_BG2X *(uint32_t *)(ppu_mmio + 0x28)
-#define REG_BG3X *(uint32_t *)(ppu_mmio + 0x38)
-#define REG_BG2Y *(uint32_t *)(ppu_mmio + 0x2C)
-#define REG_BG3Y *(uint32_t *)(ppu_mmio + 0x3C)
-
-#define REG_WIN0H *(uint16_t *)(ppu_mmio + 0x40)
-#define REG_WIN1H *(uint16_t *)(ppu_mmio + 0x42)
-#define REG_WIN0V *(uint16_t *)(ppu_mmio + 0x44)
-#define REG_WIN1V *(uint16_t *)(ppu_mmio + 0x46)
-#define REG_WININ *(uint16_t *)(ppu_mmio + 0x48)
-#define REG_WINOUT *(uint16_t *)(ppu_mmio + 0x4A)
-
-#define REG_MOSAIC *(uint16_t *)(ppu_mmio + 0x4C)
-#define REG_BLDCNT *(uint16_t *)(ppu_mmio + 0x50)
-#define REG_BLDALPHA *(uint16_t *)(ppu_mmio + 0x52)
-#define REG_BLDY *(uint16_t *)(ppu_mmio + 0x54)
+#define REG_BG0HOFS *(uint16_t *)(view->mmio + 0x10)
+#define REG_BG0VOFS *(uint16_t *)(view->mmio + 0x12)
+#define REG_BG1HOFS *(uint16_t *)(view->mmio + 0x14)
+#define REG_BG1VOFS *(uint16_t *)(view->mmio + 0x16)
+#define REG_BG2HOFS *(uint16_t *)(view->mmio + 0x18)
+#define REG_BG2VOFS *(uint16_t *)(view->mmio + 0x1A)
+#define REG_BG3HOFS *(uint16_t *)(view->mmio + 0x1C)
+#define REG_BG3VOFS *(uint16_t *)(view->mmio + 0x1E)
+#define REG_BGHOFS(n) *(uint16_t *)(view->mmio + 0x10 + ((n) * 4))
+#define REG_BGVOFS(n) *(uint16_t *)(view->mmio + 0x12 + ((n) * 4))
+
+#define REG_BG2PA *(uint16_t *)(gba->ppu_mmio + 0x20)
+#define REG_BG3PA *(uint16_t *)(gba->ppu_mmio + 0x30)
+#define REG_BG2PB *(uint16_t *)(gba->ppu_mmio + 0x22)
+#define REG_BG3PB *(uint16_t *)(gba->ppu_mmio + 0x32)
+#define REG_BG2PC *(uint16_t *)(gba->ppu_mmio + 0x24)
+#define REG_BG3PC *(uint16_t *)(gba->ppu_mmio + 0x34)
+#define REG_BG2PD *(uint16_t *)(gba->ppu_mmio + 0x26)
+#define REG_BG3PD *(uint16_t *)(gba->ppu_mmio + 0x36)
+#define REG_BG2X *(uint32_t *)(gba->ppu_mmio + 0x28)
+#define REG_BG3X *(uint32_t *)(gba->ppu_mmio + 0x38)
+#define REG_BG2Y *(uint32_t *)(gba->ppu_mmio + 0x2C)
+#define REG_BG3Y *(uint32_t *)(gba->ppu_mmio + 0x3C)
+#define REG_BGPA(n) *(uint16_t *)(view->mmio + 0x20 + (((n) - 2) * 0x10))
+#define REG_BGPB(n) *(uint16_t *)(view->mmio + 0x22 + (((n) - 2) * 0x10))
+#define REG_BGPC(n) *(uint16_t *)(view->mmio + 0x24 + (((n) - 2) * 0x10))
+#define REG_BGPD(n) *(uint16_t *)(view->mmio + 0x26 + (((n) - 2) * 0x10))
+
+#define REG_WIN0H *(uint16_t *)(view->mmio + 0x40)
+#define REG_WIN1H *(uint16_t *)(view->mmio + 0x42)
+#define REG_WIN0V *(uint16_t *)(view->mmio + 0x44)
+#define REG_WIN1V *(uint16_t *)(view->mmio + 0x46)
+#define REG_WININ *(uint16_t *)(view->mmio + 0x48)
+#define REG_WINOUT *(uint16_t *)(view->mmio + 0x4A)
+
+#define REG_MOSAIC *(uint16_t *)(view->mmio + 0x4C)
+#define REG_BLDCNT *(uint16_t *)(view->mmio + 0x50)
+#define REG_BLDALPHA *(uint16_t *)(view->mmio + 0x52)
+#define REG_BLDY *(uint16_t *)(view->mmio + 0x54)
 
 #define CYCLES_PER_SCANLINE 1232
 #define CYCLES_PER_HDRAW    1006
 
 typedef uint16_t Pixel;
 
-Pixel frame[FRAME_HEIGHT][FRAME_WIDTH];
+// one bit per pixel of a scanline (240 of the 256 bits are used)
+typedef uint64_t ScanlineMask[4];
+
+// each background renders the current scanline into its own line buffer, along with
+// a mask per pixel (0xFFFF when opaque, 0 when transparent) so layers can be merged without branching.
+// these are scratch space for whichever thread is rendering, so they are thread local
+static __thread Pixel bg_line[4][FRAME_WIDTH];
+static __thread uint16_t bg_opaque[4][FRAME_WIDTH];
+
+// each thread that renders points this at its own view
+static __thread PpuView *view;
+
+// which pixels of the current scanline each layer (and color special effects) may appear on,
+// computed once per scanline from the window registers
+static __thread ScanlineMask layer_window[NUM_LAYERS];
+
+// looks up the colors for a run of 8-bit pallete indices. index 0 is transparent, so the opaque
+// mask is built alongside the colors (and skipped when opaque is NULL)
+static void pallete_gather_scalar(Pixel *dst, uint16_t *opaque, const uint8_t *indices, int count, const uint8_t *pallete) {
+    for (int i = 0; i < count; i++)
+        dst[i] = *(uint16_t *)(pallete + (indices[i] * sizeof(Pixel)));
+
+    if (opaque)
+        for (int i = 0; i < count; i++)
+            opaque[i] = -(uint16_t)(indices[i] != 0);
+}
 
-uint8_t vram[0x18000];
-uint8_t oam[0x400];
-uint8_t pallete_ram[0x400];
-uint8_t ppu_mmio[0x56];
+#ifdef HAVE_X86_GATHER
+// 16 pixels at a time with two 8 wide gathers. each lane loads 32 bits at the color's address and
+// keeps the low half, which stays inside pallete ram since only the first 256 colors are indexed
+__attribute__((target("avx2")))
+static void pallete_gather_avx2(Pixel *dst, uint16_t *opaque, const uint8_t *indices, int count, const uint8_t *pallete) {
+    const __m256i low_half = _mm256_set1_epi32(0xFFFF);
+    int i = 0;
 
-uint8_t reg_vcount = 0;
-bool is_rendering_bitmap = false;
+    for (; i + 16 <= count; i += 16) {
+        __m128i idx = _mm_loadu_si128((const __m128i *)(indices + i));
 
-int cycles = 0;
+        __m256i lo = _mm256_i32gather_epi32((const int *)pallete, _mm256_cvtepu8_epi32(idx), sizeof(Pixel));
+        __m256i hi = _mm256_i32gather_epi32((const int *)pallete, _mm256_cvtepu8_epi32(_mm_srli_si128(idx, 8)), sizeof(Pixel));
+
+        // packus interleaves the 128-bit lanes of both sources, the permute puts them back in order
+        __m256i colors = _mm256_packus_epi32(_mm256_and_si256(lo, low_half), _mm256_and_si256(hi, low_half));
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_permute4x64_epi64(colors, 0xD8));
+
+        if (opaque) {
+            __m256i transparent = _mm256_cmpeq_epi16(_mm256_cvtepu8_epi16(idx), _mm256_setzero_si256());
+            _mm256_storeu_si256((__m256i *)(opaque + i), _mm256_xor_si256(transparent, _mm256_set1_epi16(-1)));
+        }
+    }
+
+    pallete_gather_scalar(dst + i, opaque ? opaque + i : NULL, indices + i, count - i, pallete);
+}
+#endif
+
+static void (*pallete_gather)(Pixel *dst, uint16_t *opaque, const uint8_t *indices, int count, const uint8_t *pallete) = pallete_gather_scalar;
+
+// picks the fastest gather the host supports before anything can render
+__attribute__((constructor))
+static void select_pallete_gather(void) {
+#ifdef HAVE_X86_GATHER
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        pallete_gather = pallete_gather_avx2;
+#endif
+}
 
 // referenced from https://www.coranac.com/tonc/text/regbg.htm
 // terms here are multiplied by 2 since each screen entry is 2 bytes (uint16_t)
-static int compute_se_idx(int tile_x, int tile_y, bool bg_reg_64x64) {
-    int se_idx = (tile_y * (32 * 2)) + (tile_x * 2);
+// maps are made of 32x32 screenblocks, so the lower screenblock of a 64 wide map is two blocks ahead
+static int compute_se_idx(int tile_x, int tile_y, bool bg_reg_64_wide) {
+    int se_idx = ((tile_y & 31) * (32 * 2)) + ((tile_x & 31) * 2);
 
     if (tile_x >= 32)
-        se_idx += (0x03E0 * 2);
-    if (tile_y >= 32) {
         se_idx += (0x0400 * 2);
+    if (tile_y >= 32) {
+        se_idx += ((bg_reg_64_wide ? 0x0800 : 0x0400) * 2);
     }
 
     return se_idx;
 }
 
-static void render_text_bg(uint16_t reg_bgcnt, uint16_t reg_bghofs, uint16_t reg_bgvofs) {
-    int num_tiles_x = 32 * (1 + ((reg_bgcnt >> 0xE) & 1));
+// one row of a tile as pallete indices. the color mode and horizontal flip are compile time
+// constants in every use, so the loop carries no branches and can be unrolled
+#define RENDER_TILE_ROW(dst, row, pallete_bank, bpp8, hflip) \
+    for (int px = 0; px < 8; px++) { \
+        int src_px = (hflip) ? 7 - px : px; \
+        uint8_t color_id = (bpp8) ? (row)[src_px] : ((row)[src_px / 2] >> ((src_px & 1) * 4)) & 0xF; \
+        /* color 0 of any pallete is transparent and stored as index 0 */ \
+        (dst)[px] = ((bpp8) || !color_id) ? color_id : (pallete_bank) | color_id; \
+    }
+
+// whether every column of [start, end) that is on screen is set
+static bool mask_span_full(const ScanlineMask mask, int start, int end) {
+    for (int col = (start < 0) ? 0 : start; col < MIN(end, FRAME_WIDTH); col++)
+        if (!((mask[col >> 6] >> (col & 63)) & 1))
+            return false;
+    return true;
+}
+
+// text background scanline renderer for one color mode and map width. whole tiles are decoded
+// from the first visible one onwards and the fine horizontal scroll is dropped when looking up colors.
+// tiles landing entirely on covered pixels (if given) are left transparent
+#define DEFINE_TEXT_BG_RENDERER(name, bpp8, wide) \
+static void name(int bg, uint8_t *tile_map, uint8_t *tile_set, int tile_x, int tile_y, int tile_row, int fine_x, const uint64_t *covered) { \
+    uint8_t indices[FRAME_WIDTH + 8]; \
+    \
+    for (int col = 0; col < FRAME_WIDTH + fine_x; col += 8) { \
+        if (covered && mask_span_full(covered, col - fine_x, col - fine_x + 8)) { \
+            memset(&indices[col], 0, 8); \
+            tile_x = (tile_x + 1) & ((wide) ? 63 : 31); \
+            gba->frame_stats.tiles_culled++; \
+            continue; \
+        } \
+        \
+        uint16_t screen_entry = *(uint16_t *)(tile_map + compute_se_idx(tile_x, tile_y, wide)); \
+        uint8_t pallete_bank = (((screen_entry >> 0xC) & 0xF) << 4); \
+        bool vertical_flip = (screen_entry >> 0xB) & 1; \
+        \
+        uint8_t *row = tile_set + ((screen_entry & 0x3FF) * ((bpp8) ? 0x40 : 0x20)); \
+        row += ((bpp8) ? 8 : 4) * (vertical_flip ? 7 - tile_row : tile_row); \
+        \
+        if ((screen_entry >> 0xA) & 1) { \
+            RENDER_TILE_ROW(&indices[col], row, pallete_bank, bpp8, true) \
+        } else { \
+            RENDER_TILE_ROW(&indices[col], row, pallete_bank, bpp8, false) \
+        } \
+        \
+        tile_x = (tile_x + 1) & ((wide) ? 63 : 31); \
+    } \
+    \
+    pallete_gather(bg_line[bg], bg_opaque[bg], &indices[fine_x], FRAME_WIDTH, view->pallete_ram); \
+}
+
+DEFINE_TEXT_BG_RENDERER(render_text_bg_4bpp, false, false)
+DEFINE_TEXT_BG_RENDERER(render_text_bg_4bpp_wide, false, true)
+DEFINE_TEXT_BG_RENDERER(render_text_bg_8bpp, true, false)
+DEFINE_TEXT_BG_RENDERER(render_text_bg_8bpp_wide, true, true)
+
+typedef void (*TextBgRenderer)(int bg, uint8_t *tile_map, uint8_t *tile_set, int tile_x, int tile_y, int tile_row, int fine_x, const uint64_t *covered);
+
+// indexed by color mode and whether the map is 64 tiles wide
+static const TextBgRenderer text_bg_renderers[2][2] = {
+    { render_text_bg_4bpp, render_text_bg_4bpp_wide },
+    { render_text_bg_8bpp, render_text_bg_8bpp_wide },
+};
+
+static void render_text_bg(int bg, uint16_t reg_bgcnt, uint16_t reg_bghofs, uint16_t reg_bgvofs, const uint64_t *covered) {
+    bool wide = (reg_bgcnt >> 0xE) & 1;
     int num_tiles_y = 32 * (1 + ((reg_bgcnt >> 0xF) & 1));
 
-    uint8_t *tile_map = vram + (((reg_bgcnt >> 0x8) & 0x1F) * 0x800);
-    uint8_t *tile_set = vram + (((reg_bgcnt >> 0x2) & 0x3) * 0x4000);
+    uint8_t *tile_map = view->vram + (((reg_bgcnt >> 0x8) & 0x1F) * 0x800);
+    uint8_t *tile_set = view->vram + (((reg_bgcnt >> 0x2) & 0x3) * 0x4000);
     bool color_pallete = (reg_bgcnt >> 0x7) & 1;
-    bool mosaic_enable = (reg_bgcnt >> 0x6) & 1;
-    int bpp = 4 << color_pallete;
 
-    if (mosaic_enable) {
-        printf("unimplemented: mosaic bit set\n");
-        exit(1);
-    }
+    // vertical mosaic repeats the first scanline of every block
+    int line = BGCNT_MOSAIC(reg_bgcnt) ? view->vcount - (view->vcount % MOSAIC_BG_V) : view->vcount;
 
     uint16_t scroll_x = reg_bghofs & 0x3FF;
     uint16_t scroll_y = reg_bgvofs & 0x3FF;
 
-    int tile_y_offset = ((reg_vcount & ~7) / 8);
-    int tile_y = (((scroll_y & ~7) / 8) + tile_y_offset) & (num_tiles_y - 1);
-    int tile_x = ((scroll_x & ~7) / 8) & (num_tiles_x - 1);
+    int tile_y = ((scroll_y + line) / 8) & (num_tiles_y - 1);
+    int tile_x = (scroll_x / 8) & ((32 << wide) - 1);
 
-    int scanline_px_rendered = 0;
+    text_bg_renderers[color_pallete][wide](bg, tile_map, tile_set, tile_x, tile_y, (scroll_y + line) & 7, scroll_x & 7, covered);
+}
 
-    while (true) {
-        uint16_t screen_entry = *(uint16_t *)(tile_map + compute_se_idx(tile_x, tile_y, num_tiles_y == 64));
+#define BGCNT_CACHE_LAYOUT 0xDF8C // screen size, map base, color mode and tile base
 
-        int tile_id = screen_entry & 0x3FF;
-        uint8_t *tile = tile_set + (tile_id * (0x20 << color_pallete));
-        uint8_t pallete_bank = (((screen_entry >> 0xC) & 0xF) << 4); // only used in 4bpp
+static void invalidate_bg_cache(BgCache *cache) {
+    cache->valid = true;
+    cache->tiles_changed = false;
+    memset(cache->entry_dirty, true, sizeof(cache->entry_dirty));
+    memset(cache->tile_changed, false, sizeof(cache->tile_changed));
+}
 
-        bool horizontal_flip = (screen_entry >> 0xA) & 1;  
-        bool vertical_flip = (screen_entry >> 0xB) & 1;
+// translates the dirty vram blocks into dirty screen entries for every cached background
+static void sync_bg_caches(void) {
+    for (int word = 0; word < VRAM_DIRTY_WORDS; word++) {
+        uint64_t dirty = view->vram_dirty[word];
+        view->vram_dirty[word] = 0;
 
-        int tile_row_to_render = (reg_vcount - (reg_vcount & ~7));
-        tile += bpp * (vertical_flip ? 7 - tile_row_to_render : tile_row_to_render);
+        while (dirty) {
+            uint32_t addr = ((word * 64) + __builtin_ctzll(dirty)) * 32;
+            dirty &= dirty - 1;
 
-        int start, end, step;
+            for (int bg = 0; bg < 4; bg++) {
+                BgCache *cache = &gba->bg_cache[bg];
+                if (!cache->valid) continue;
 
-        if (horizontal_flip) {
-            start = 3;
-            end = -1;
-            step = -1;
-        } else {
-            start = 0;
-            end = 4;
-            step = 1;
+                uint32_t map_base = ((cache->layout >> 0x8) & 0x1F) * 0x800;
+                uint32_t map_size = 0x800 << (((cache->layout >> 0xE) & 1) + ((cache->layout >> 0xF) & 1));
+                uint32_t tile_base = ((cache->layout >> 0x2) & 0x3) * 0x4000;
+                uint32_t tile_size = 0x20 << ((cache->layout >> 0x7) & 1);
+
+                if ((addr >= map_base) && (addr < map_base + map_size))
+                    memset(&cache->entry_dirty[(addr - map_base) / 2], true, 32 / 2);
+
+                if ((addr >= tile_base) && (addr < tile_base + (1024 * tile_size))) {
+                    cache->tile_changed[(addr - tile_base) / tile_size] = true;
+                    cache->tiles_changed = true;
+                }
+            }
+        }
+    }
+
+    // a change in tile data dirties every screen entry that points at the tile
+    for (int bg = 0; bg < 4; bg++) {
+        BgCache *cache = &gba->bg_cache[bg];
+        if (!cache->valid || !cache->tiles_changed) continue;
+
+        uint16_t *tile_map = (uint16_t *)(view->vram + (((cache->layout >> 0x8) & 0x1F) * 0x800));
+        int num_entries = 0x400 << (((cache->layout >> 0xE) & 1) + ((cache->layout >> 0xF) & 1));
+
+        for (int i = 0; i < num_entries; i++)
+            if (cache->tile_changed[tile_map[i] & 0x3FF])
+                cache->entry_dirty[i] = true;
+
+        cache->tiles_changed = false;
+        memset(cache->tile_changed, false, sizeof(cache->tile_changed));
+    }
+}
+
+static void render_bg_cache_entry(BgCache *cache, int tile_x, int tile_y) {
+    uint8_t *tile_map = view->vram + (((cache->layout >> 0x8) & 0x1F) * 0x800);
+    uint8_t *tile_set = view->vram + (((cache->layout >> 0x2) & 0x3) * 0x4000);
+    bool color_pallete = (cache->layout >> 0x7) & 1;
+
+    int se_idx = compute_se_idx(tile_x, tile_y, (cache->layout >> 0xE) & 1);
+    uint16_t screen_entry = *(uint16_t *)(tile_map + se_idx);
+    cache->entry_dirty[se_idx / 2] = false;
+
+    uint8_t *tile = tile_set + ((screen_entry & 0x3FF) * (0x20 << color_pallete));
+    uint8_t pallete_bank = (((screen_entry >> 0xC) & 0xF) << 4); // only used in 4bpp
+    int flip_x = ((screen_entry >> 0xA) & 1) * 7;
+    int flip_y = ((screen_entry >> 0xB) & 1) * 7;
+
+    for (int row = 0; row < 8; row++) {
+        uint8_t *dst = &cache->pixels[(tile_y * 8) + (row ^ flip_y)][tile_x * 8];
+
+        for (int px = 0; px < 8; px++) {
+            uint8_t color_id = color_pallete ? tile[(row * 8) + px] : (tile[(row * 4) + (px / 2)] >> ((px & 1) * 4)) & 0xF;
+            // color 0 of any pallete is transparent and stored as index 0
+            dst[px ^ flip_x] = (color_pallete || !color_id) ? color_id : pallete_bank | color_id;
+        }
+    }
+}
+
+static void render_cached_text_bg(int bg, uint16_t reg_bgcnt, uint16_t reg_bghofs, uint16_t reg_bgvofs) {
+    BgCache *cache = &gba->bg_cache[bg];
+
+    if (!cache->valid || (cache->layout != (reg_bgcnt & BGCNT_CACHE_LAYOUT))) {
+        cache->layout = reg_bgcnt & BGCNT_CACHE_LAYOUT;
+        invalidate_bg_cache(cache);
+    }
+
+    int width = 256 << ((reg_bgcnt >> 0xE) & 1);
+    int height = 256 << ((reg_bgcnt >> 0xF) & 1);
+    int line = BGCNT_MOSAIC(reg_bgcnt) ? view->vcount - (view->vcount % MOSAIC_BG_V) : view->vcount;
+
+    int x = reg_bghofs & (width - 1);
+    int y = ((reg_bgvofs & 0x3FF) + line) & (height - 1);
+
+    // a scanline touches at most 31 screen entries when the scroll isn't tile aligned
+    for (int i = 0; i < 31; i++) {
+        int tile_x = ((x / 8) + i) & ((width / 8) - 1);
+        if (cache->entry_dirty[compute_se_idx(tile_x, y / 8, width == 512) / 2])
+            render_bg_cache_entry(cache, tile_x, y / 8);
+    }
+
+    // the cached row wraps at most once since backgrounds are at least 256 pixels wide
+    uint8_t indices[FRAME_WIDTH];
+    int first_span = MIN(width - x, FRAME_WIDTH);
+    memcpy(indices, &cache->pixels[y][x], first_span);
+    memcpy(indices + first_span, &cache->pixels[y][0], FRAME_WIDTH - first_span);
+
+    pallete_gather(bg_line[bg], bg_opaque[bg], indices, FRAME_WIDTH, view->pallete_ram);
+}
+
+void enable_bg_cache(bool enable) {
+    gba->bg_cache_enabled = enable;
+
+    for (int bg = 0; bg < 4; bg++)
+        gba->bg_cache[bg].valid = false;
+}
+
+// referenced from https://www.coranac.com/tonc/text/affbg.htm
+// the texture coordinates start at the latched reference point and advance by (PA, PC) per pixel.
+// with wraparound every coordinate is folded back into the map, otherwise coordinates are left as
+// is and anything outside of the map is transparent (pallete index 0)
+typedef struct {
+    const uint8_t *tile_map;
+    const uint8_t *tile_set;
+    int size_shift; // 128, 256, 512 or 1024 pixels square
+    uint32_t size_mask;
+    uint32_t wrap_mask;
+    int32_t tex_x;
+    int32_t tex_y;
+    int32_t pa;
+    int32_t pc;
+} AffineLine;
+
+static void affine_indices_scalar(uint8_t *indices, const AffineLine *line, int first, int count) {
+    for (int i = first; i < count; i++) {
+        uint32_t px = (uint32_t)((line->tex_x + (i * line->pa)) >> 8) & line->wrap_mask;
+        uint32_t py = (uint32_t)((line->tex_y + (i * line->pc)) >> 8) & line->wrap_mask;
+        bool in_bounds = ((px | py) & ~line->size_mask) == 0;
+        uint32_t x = px & line->size_mask;
+        uint32_t y = py & line->size_mask;
+
+        // affine screen entries are a single byte and tiles are always 8bpp
+        uint8_t tile_id = line->tile_map[((y >> 3) << (line->size_shift - 3)) + (x >> 3)];
+        indices[i] = in_bounds ? line->tile_set[(tile_id * 0x40) + ((y & 7) * 8) + (x & 7)] : 0;
+    }
+}
+
+#ifdef HAVE_X86_GATHER
+// 8 pixels at a time. both lookups gather 32 bits per lane and keep the low byte: the furthest a map
+// or tile can reach into vram still leaves the 3 bytes past it inside vram
+__attribute__((target("avx2")))
+static void affine_indices_avx2(uint8_t *indices, const AffineLine *line, int first, int count) {
+    const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    const __m256i low_byte = _mm256_set1_epi32(0xFF);
+    const __m256i wrap_mask = _mm256_set1_epi32(line->wrap_mask);
+    const __m256i size_mask = _mm256_set1_epi32(line->size_mask);
+    const __m256i outside_mask = _mm256_set1_epi32(~line->size_mask);
+    const __m128i row_shift = _mm_cvtsi32_si128(line->size_shift - 3);
+    int i = first;
+
+    __m256i tex_x = _mm256_add_epi32(_mm256_set1_epi32(line->tex_x + (i * line->pa)), _mm256_mullo_epi32(lanes, _mm256_set1_epi32(line->pa)));
+    __m256i tex_y = _mm256_add_epi32(_mm256_set1_epi32(line->tex_y + (i * line->pc)), _mm256_mullo_epi32(lanes, _mm256_set1_epi32(line->pc)));
+
+    for (; i + 8 <= count; i += 8) {
+        __m256i px = _mm256_and_si256(_mm256_srai_epi32(tex_x, 8), wrap_mask);
+        __m256i py = _mm256_and_si256(_mm256_srai_epi32(tex_y, 8), wrap_mask);
+        __m256i in_bounds = _mm256_cmpeq_epi32(_mm256_and_si256(_mm256_or_si256(px, py), outside_mask), _mm256_setzero_si256());
+        __m256i x = _mm256_and_si256(px, size_mask);
+        __m256i y = _mm256_and_si256(py, size_mask);
+
+        __m256i map_offset = _mm256_add_epi32(_mm256_sll_epi32(_mm256_srli_epi32(y, 3), row_shift), _mm256_srli_epi32(x, 3));
+        __m256i tile_id = _mm256_and_si256(_mm256_i32gather_epi32((const int *)line->tile_map, map_offset, 1), low_byte);
+
+        __m256i tile_offset = _mm256_add_epi32(_mm256_slli_epi32(tile_id, 6),
+            _mm256_add_epi32(_mm256_slli_epi32(_mm256_and_si256(y, _mm256_set1_epi32(7)), 3), _mm256_and_si256(x, _mm256_set1_epi32(7))));
+        __m256i pallete_id = _mm256_and_si256(_mm256_i32gather_epi32((const int *)line->tile_set, tile_offset, 1), _mm256_and_si256(low_byte, in_bounds));
+
+        // both packs work within 128-bit lanes, leaving pixels 0-3 in the low dword of the low lane and 4-7 in the high one
+        __m256i packed = _mm256_packus_epi16(_mm256_packus_epi32(pallete_id, pallete_id), _mm256_setzero_si256());
+        uint32_t low = _mm256_extract_epi32(packed, 0);
+        uint32_t high = _mm256_extract_epi32(packed, 4);
+        memcpy(indices + i, &low, sizeof(low));
+        memcpy(indices + i + 4, &high, sizeof(high));
+
+        tex_x = _mm256_add_epi32(tex_x, _mm256_set1_epi32(8 * line->pa));
+        tex_y = _mm256_add_epi32(tex_y, _mm256_set1_epi32(8 * line->pc));
+    }
+
+    affine_indices_scalar(indices, line, i, count);
+}
+#endif
+
+static void (*affine_indices)(uint8_t *indices, const AffineLine *line, int first, int count) = affine_indices_scalar;
+
+__attribute__((constructor))
+static void select_affine_indices(void) {
+#ifdef HAVE_X86_GATHER
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        affine_indices = affine_indices_avx2;
+#endif
+}
+
+static void render_affine_bg(int bg, uint16_t reg_bgcnt) {
+    int size_shift = 7 + ((reg_bgcnt >> 0xE) & 0x3);
+    uint32_t size_mask = (1 << size_shift) - 1;
+    bool wraparound = (reg_bgcnt >> 0xD) & 1;
+
+    AffineLine line = {
+        .tile_map = view->vram + (((reg_bgcnt >> 0x8) & 0x1F) * 0x800),
+        .tile_set = view->vram + (((reg_bgcnt >> 0x2) & 0x3) * 0x4000),
+        .size_shift = size_shift,
+        .size_mask = size_mask,
+        .wrap_mask = wraparound ? size_mask : ~0u,
+        .tex_x = view->bg_ref_x[bg - 2],
+        .tex_y = view->bg_ref_y[bg - 2],
+        .pa = (int16_t)REG_BGPA(bg),
+        .pc = (int16_t)REG_BGPC(bg),
+    };
+
+    // vertical mosaic steps back to the reference point of the first scanline in the block
+    if (BGCNT_MOSAIC(reg_bgcnt)) {
+        int mosaic_offset = view->vcount % MOSAIC_BG_V;
+        line.tex_x -= mosaic_offset * (int16_t)REG_BGPB(bg);
+        line.tex_y -= mosaic_offset * (int16_t)REG_BGPD(bg);
+    }
+
+    uint8_t indices[FRAME_WIDTH];
+    affine_indices(indices, &line, 0, FRAME_WIDTH);
+    pallete_gather(bg_line[bg], bg_opaque[bg], indices, FRAME_WIDTH, view->pallete_ram);
+}
+
+// renders BG2 of the bitmap modes into dst. when opaque is NULL the pixels are
+// going straight into the frame, so anything outside of the bitmap is left untouched
+static void render_bitmap_bg(Pixel *dst, uint16_t *opaque) {
+    uint16_t reg_bgcnt = REG_BG2CNT;
+    int line = BGCNT_MOSAIC(reg_bgcnt) ? view->vcount - (view->vcount % MOSAIC_BG_V) : view->vcount;
+
+    uint8_t *vram_base_ptr = view->vram;
+    if (DCNT_PAGE && (DCNT_MODE != 0x3)) // mode 3 has no page flipping
+        vram_base_ptr += 0xA000;
+
+    switch (DCNT_MODE) {
+    case 0x3:
+        // pixels for the frame are stored directly in vram
+        memcpy(dst, vram_base_ptr + (line * FRAME_WIDTH * sizeof(Pixel)), FRAME_WIDTH * sizeof(Pixel));
+        if (opaque)
+            memset(opaque, 0xFF, FRAME_WIDTH * sizeof(uint16_t));
+        break;
+    case 0x4:
+        // each byte in vram is interpreted as a pallete index holding a pixels color
+        pallete_gather(dst, opaque, vram_base_ptr + (line * FRAME_WIDTH), FRAME_WIDTH, view->pallete_ram);
+        break;
+    case 0x5:
+        // the 160x128 page sits in the top left corner with the backdrop around it
+        if (opaque)
+            memset(opaque, 0, FRAME_WIDTH * sizeof(uint16_t));
+
+        if (line < MODE5_HEIGHT) {
+            memcpy(dst, vram_base_ptr + (line * MODE5_WIDTH * sizeof(Pixel)), MODE5_WIDTH * sizeof(Pixel));
+            if (opaque)
+                memset(opaque, 0xFF, MODE5_WIDTH * sizeof(uint16_t));
+        }
+        break;
+    }
+}
+
+// horizontal mosaic is applied after the fact by stretching the first pixel of every block
+static void apply_mosaic(int bg) {
+    int size = MOSAIC_BG_H;
+
+    for (int col = 0; col < FRAME_WIDTH; col += size) {
+        for (int i = 1; (i < size) && ((col + i) < FRAME_WIDTH); i++) {
+            bg_line[bg][col + i] = bg_line[bg][col];
+            bg_opaque[bg][col + i] = bg_opaque[bg][col];
+        }
+    }
+}
+
+static void set_mask_span(ScanlineMask mask, int start, int end) {
+    for (int word = 0; word < 4; word++) {
+        int lo = start - (word * 64);
+        int hi = end - (word * 64);
+        if (lo < 0) lo = 0;
+        if (hi > 64) hi = 64;
+        if (lo >= hi) continue;
+
+        uint64_t bits = (hi - lo) == 64 ? ~UINT64_C(0) : (UINT64_C(1) << (hi - lo)) - 1;
+        mask[word] |= bits << lo;
+    }
+}
+
+// returns the first column at or after col whose bit matches set (or FRAME_WIDTH if there are none)
+static int find_mask_bit(const ScanlineMask mask, int col, bool set) {
+    while (col < FRAME_WIDTH) {
+        uint64_t word = (set ? mask[col >> 6] : ~mask[col >> 6]) >> (col & 63);
+        if (word)
+            return MIN(col + __builtin_ctzll(word), FRAME_WIDTH);
+        col = (col | 63) + 1;
+    }
+    return FRAME_WIDTH;
+}
+
+// walks the runs of set bits in a mask, so windowed layers are processed span by span
+// instead of testing the window for every pixel
+static bool next_mask_span(const ScanlineMask mask, int *start, int *end) {
+    *start = find_mask_bit(mask, *end, true);
+    if (*start >= FRAME_WIDTH)
+        return false;
+
+    *end = find_mask_bit(mask, *start, false);
+    return true;
+}
+
+// the right/bottom edges are exclusive, values past the screen are clamped and
+// a window whose start is past its end wraps around the screen
+static bool in_window_range(int pos, uint16_t reg_winrange, int limit) {
+    int start = reg_winrange >> 8;
+    int end = MIN(reg_winrange & 0xFF, limit);
+
+    if (start <= end)
+        return pos >= start && pos < end;
+    return pos >= start || pos < end;
+}
+
+static void set_window_span(ScanlineMask mask, uint16_t reg_winh) {
+    int start = reg_winh >> 8;
+    int end = MIN(reg_winh & 0xFF, FRAME_WIDTH);
+
+    if (start <= end) {
+        set_mask_span(mask, start, end);
+    } else {
+        set_mask_span(mask, start, FRAME_WIDTH);
+        set_mask_span(mask, 0, end);
+    }
+}
+
+// resolves WIN0, WIN1 and the outside region for the current scanline into a mask per layer.
+// WIN0 takes precedence over WIN1, and the OBJ window never covers anything since sprites aren't rendered
+static void compute_window_masks(void) {
+    if (!DCNT_WIN0 && !DCNT_WIN1 && !DCNT_WINOBJ) {
+        for (int layer = 0; layer < NUM_LAYERS; layer++)
+            for (int word = 0; word < 4; word++)
+                layer_window[layer][word] = ~UINT64_C(0);
+        return;
+    }
+
+    ScanlineMask win0 = {0};
+    ScanlineMask win1 = {0};
+
+    if (DCNT_WIN0 && in_window_range(view->vcount, REG_WIN0V, FRAME_HEIGHT))
+        set_window_span(win0, REG_WIN0H);
+    if (DCNT_WIN1 && in_window_range(view->vcount, REG_WIN1V, FRAME_HEIGHT))
+        set_window_span(win1, REG_WIN1H);
+
+    for (int layer = 0; layer < NUM_LAYERS; layer++) {
+        uint64_t in_win0 = -(uint64_t)((REG_WININ >> layer) & 1);
+        uint64_t in_win1 = -(uint64_t)((REG_WININ >> (layer + 8)) & 1);
+        uint64_t in_outside = -(uint64_t)((REG_WINOUT >> layer) & 1);
+
+        for (int word = 0; word < 4; word++) {
+            uint64_t win1_only = win1[word] & ~win0[word];
+            uint64_t outside = ~(win0[word] | win1[word]);
+            layer_window[layer][word] = (win0[word] & in_win0) | (win1_only & in_win1) | (outside & in_outside);
+        }
+    }
+}
+
+static Pixel blend_pixels(Pixel a, Pixel b, int eva, int evb) {
+    int r = MIN((((a >> 0) & 0x1F) * eva + ((b >> 0) & 0x1F) * evb) >> 4, 0x1F);
+    int g = MIN((((a >> 5) & 0x1F) * eva + ((b >> 5) & 0x1F) * evb) >> 4, 0x1F);
+    int bl = MIN((((a >> 10) & 0x1F) * eva + ((b >> 10) & 0x1F) * evb) >> 4, 0x1F);
+    return r | (g << 5) | (bl << 10);
+}
+
+static Pixel brighten_pixel(Pixel a, int evy) {
+    int r = (a >> 0) & 0x1F;
+    int g = (a >> 5) & 0x1F;
+    int b = (a >> 10) & 0x1F;
+    r += ((0x1F - r) * evy) >> 4;
+    g += ((0x1F - g) * evy) >> 4;
+    b += ((0x1F - b) * evy) >> 4;
+    return r | (g << 5) | (b << 10);
+}
+
+static Pixel darken_pixel(Pixel a, int evy) {
+    int r = (a >> 0) & 0x1F;
+    int g = (a >> 5) & 0x1F;
+    int b = (a >> 10) & 0x1F;
+    r -= (r * evy) >> 4;
+    g -= (g * evy) >> 4;
+    b -= (b * evy) >> 4;
+    return r | (g << 5) | (b << 10);
+}
+
+// applies the BLDCNT effect, only over the columns the windows allow effects on
+static void apply_color_effects(Pixel *scanline, const uint8_t *top_id, const Pixel *under, const uint8_t *under_id) {
+    uint8_t effect = BLDCNT_EFFECT;
+    uint8_t first_target = REG_BLDCNT & 0x3F;
+    uint8_t second_target = (REG_BLDCNT >> 8) & 0x3F;
+
+    int eva = MIN(REG_BLDALPHA & 0x1F, 16);
+    int evb = MIN((REG_BLDALPHA >> 8) & 0x1F, 16);
+    int evy = MIN(REG_BLDY & 0x1F, 16);
+
+    int start, end = 0;
+    while (next_mask_span(layer_window[WINDOW_FX], &start, &end)) {
+        for (int col = start; col < end; col++) {
+            if (!((first_target >> top_id[col]) & 1))
+                continue;
+
+            switch (effect) {
+            case EFFECT_ALPHA:
+                if ((second_target >> under_id[col]) & 1)
+                    scanline[col] = blend_pixels(scanline[col], under[col], eva, evb);
+                break;
+            case EFFECT_BRIGHTEN:
+                scanline[col] = brighten_pixel(scanline[col], evy);
+                break;
+            case EFFECT_DARKEN:
+                scanline[col] = darken_pixel(scanline[col], evy);
+                break;
+            }
         }
+    }
+}
+
+// fills the scanline with the backdrop (first entry in pallete RAM)
+static void render_backdrop(void) {
+    Pixel backdrop = *(uint16_t *)view->pallete_ram;
+
+    for (int col = 0; col < FRAME_WIDTH; col++)
+        gba->frame[view->vcount][col] = backdrop;
+}
 
-        for (int i = start; i != end; i += step) {
-            for (int nibble = horizontal_flip; nibble != (!horizontal_flip + step); nibble += step) {
-                if (scanline_px_rendered >= FRAME_WIDTH) return;
+// merges the rendered backgrounds in bg_mask onto the backdrop, lowest priority first.
+// for equal priorities the lower numbered background is drawn on top. the two topmost
+// layers of every pixel are kept around for alpha blending
+static void composite_bgs(uint8_t bg_mask) {
+    Pixel *scanline = gba->frame[view->vcount];
+    uint8_t top_id[FRAME_WIDTH];
+    Pixel under[FRAME_WIDTH];
+    uint8_t under_id[FRAME_WIDTH];
 
-                int px = i * 2 + nibble;
-                if (!scanline_px_rendered && (px < (scroll_x - (scroll_x & ~7)))) continue;
+    render_backdrop();
+    memcpy(under, scanline, sizeof(under));
+    memset(top_id, LAYER_BD, sizeof(top_id));
+    memset(under_id, LAYER_BD, sizeof(under_id));
 
-                uint8_t pallete_id = color_pallete ? tile[px] : pallete_bank | ((tile[i] >> (nibble * 4)) & 0x0F);
-                frame[reg_vcount][scanline_px_rendered++] = *(uint16_t *)(pallete_ram + (pallete_id * sizeof(Pixel)));
+    for (int prio = 3; prio >= 0; prio--) {
+        for (int bg = 3; bg >= 0; bg--) {
+            if (!((bg_mask >> bg) & 1) || (BGCNT_PRIO(REG_BGCNT(bg)) != prio))
+                continue;
+
+            int start, end = 0;
+            while (next_mask_span(layer_window[bg], &start, &end)) {
+                for (int col = start; col < end; col++) {
+                    uint16_t opaque = bg_opaque[bg][col];
+                    uint8_t opaque_id = opaque;
+
+                    under[col] = (under[col] & ~opaque) | (scanline[col] & opaque);
+                    under_id[col] = (under_id[col] & ~opaque_id) | (top_id[col] & opaque_id);
+                    scanline[col] = (scanline[col] & ~opaque) | (bg_line[bg][col] & opaque);
+                    top_id[col] = (top_id[col] & ~opaque_id) | (bg & opaque_id);
+                }
             }
         }
+    }
+
+    if (BLDCNT_EFFECT != EFFECT_NONE)
+        apply_color_effects(scanline, top_id, under, under_id);
+}
+
+// adds the opaque pixels of a rendered background that show through its window
+static void add_layer_coverage(ScanlineMask covered, int bg) {
+    ScanlineMask opaque = {0};
+
+    for (int col = 0; col < FRAME_WIDTH; col++)
+        opaque[col >> 6] |= (uint64_t)(bg_opaque[bg][col] & 1) << (col & 63);
+
+    for (int word = 0; word < 4; word++)
+        covered[word] |= opaque[word] & layer_window[bg][word];
+}
+
+// whether every pixel the background shows through its window is covered
+static bool layer_covered(const ScanlineMask covered, int bg) {
+    for (int word = 0; word < 4; word++)
+        if (layer_window[bg][word] & ~covered[word])
+            return false;
+    return true;
+}
+
+// renders the tiled backgrounds in bg_mask front to back. a layer is skipped when the layers in front
+// of it already cover every pixel its window shows, and text layers skip the tiles that are covered.
+// alpha blending needs the layer under the top one too, so nothing is culled while it is enabled.
+// returns the backgrounds that were rendered
+static uint8_t render_tiled_bgs(uint8_t bg_mask) {
+    // columns past the edge of the screen count as covered
+    ScanlineMask covered = { 0, 0, 0, ~UINT64_C(0) << (FRAME_WIDTH - 192) };
+    bool cull = BLDCNT_EFFECT != EFFECT_ALPHA;
+    uint8_t rendered = 0;
+
+    for (int prio = 0; prio < 4; prio++) {
+        for (int bg = 0; bg < 4; bg++) {
+            uint16_t reg_bgcnt = REG_BGCNT(bg);
+            if (!((bg_mask >> bg) & 1) || (BGCNT_PRIO(reg_bgcnt) != prio))
+                continue;
+
+            if (cull && layer_covered(covered, bg)) {
+                gba->frame_stats.layers_culled++;
+                continue;
+            }
+
+            bool affine = (DCNT_MODE == 0x2) || ((DCNT_MODE == 0x1) && (bg == 2));
+            bool mosaic = BGCNT_MOSAIC(reg_bgcnt) && (MOSAIC_BG_H > 1);
 
-        tile_x = (tile_x + 1) & (num_tiles_x - 1);
+            if (affine) {
+                render_affine_bg(bg, reg_bgcnt);
+            } else if (gba->bg_cache_enabled) {
+                render_cached_text_bg(bg, reg_bgcnt, REG_BGHOFS(bg), REG_BGVOFS(bg));
+            } else {
+                // horizontal mosaic stretches pixels over their neighbours, which may be covered
+                render_text_bg(bg, reg_bgcnt, REG_BGHOFS(bg), REG_BGVOFS(bg), (cull && !mosaic) ? covered : NULL);
+            }
+
+            if (mosaic)
+                apply_mosaic(bg);
+
+            gba->frame_stats.layers_rendered++;
+            rendered |= 1 << bg;
+
+            if (cull)
+                add_layer_coverage(covered, bg);
+        }
     }
+
+    return rendered;
 }
 
 static void render_scanline(void) {
+    gba->frame_stats.lines_rendered++;
+
     // used to manage rendering priorities
     if (DCNT_BLANK) {
         for (int row = 0; row < FRAME_WIDTH; row++) 
-            frame[reg_vcount][row] = 0xFFFF;
+            gba->frame[view->vcount][row] = 0xFFFF;
         return;
     }
 
-    // check if any rendering enable bits are set
-    if ((REG_DISPCNT >> 8) & 0xFF) {
-        switch (DCNT_MODE) {
-        // tilemap modes
-        case 0x0: {
-            int prio = 0;
+    uint8_t bg_mask = 0;
 
-            if (DCNT_BG0) {
-                prio = BGCNT_PRIO(REG_BG0CNT);
-                render_text_bg(REG_BG0CNT, REG_BG0HOFS, REG_BG0VOFS);
-            }
+    if (gba->bg_cache_enabled)
+        sync_bg_caches();
 
-            int bg1_prio = BGCNT_PRIO(REG_BG1CNT);
-            if (DCNT_BG1 && (bg1_prio > prio)) {
-                prio = bg1_prio;
-                render_text_bg(REG_BG1CNT, REG_BG1HOFS, REG_BG1VOFS);
-            }
+    switch (DCNT_MODE) {
+    // tilemap modes
+    case 0x0:
+        bg_mask = (REG_DISPCNT >> 8) & 0xF;
+        break;
+    case 0x1:
+        // BG0 and BG1 are text backgrounds, BG2 is affine and BG3 is unused
+        bg_mask = (REG_DISPCNT >> 8) & 0x7;
+        break;
+    case 0x2:
+        // only BG2 and BG3 are available, both affine
+        bg_mask = (REG_DISPCNT >> 8) & 0xC;
+        break;
 
-            int bg2_prio = BGCNT_PRIO(REG_BG2CNT);
-            if (DCNT_BG2 && (bg2_prio > prio)) {
-                prio = bg2_prio;
-                render_text_bg(REG_BG2CNT, REG_BG2HOFS, REG_BG2VOFS);
-            }
+    // bitmap modes
+    case 0x3:
+    case 0x4:
+    case 0x5:
+        bg_mask = (REG_DISPCNT >> 8) & 0x4;
 
-            int bg3_prio = BGCNT_PRIO(REG_BG3CNT);
-            if (DCNT_BG3 && (bg3_prio > prio)) {
-                prio = bg3_prio;
-                render_text_bg(REG_BG3CNT, REG_BG3HOFS, REG_BG3VOFS);
-            } 
-            break;
+        // without windows, blending or mosaic the bitmap goes straight into the frame
+        if (!bg_mask) {
+            render_backdrop();
+            return;
         }
-        case 0x1:
-        case 0x2:
-            fprintf(stderr, "video mode: %d not implemented yet\n", DCNT_MODE);
-            exit(1);
-
-        // bitmap modes
-        case 0x3:
-            if (DCNT_BG2) {
-                uint8_t *vram_base_ptr = vram;
-                if (DCNT_PAGE)
-                    vram_base_ptr += 0xA000;
-
-                for (int col = 0; col < FRAME_WIDTH; col++) // pixels for the frame are stored directly in vram
-                    frame[reg_vcount][col] = *(uint16_t *)(vram + (reg_vcount * (FRAME_WIDTH * sizeof(Pixel))) + (col * sizeof(Pixel)));
-            }
-            break;
-        case 0x4:
-            if (DCNT_BG2) {
-                uint8_t *vram_base_ptr = vram;
-                if (DCNT_PAGE) 
-                    vram_base_ptr += 0xA000;
-
-                for (int col = 0; col < FRAME_WIDTH; col++) {
-                    // each byte in vram is interpreted as a pallete index holding a pixels color
-                    uint8_t pallete_idx = *(vram_base_ptr + (reg_vcount * FRAME_WIDTH) + col);
-                    // copy the 15bpp color to the associated pixel on the frame
-                    frame[reg_vcount][col] = *(uint16_t *)(pallete_ram + pallete_idx * sizeof(Pixel));
-                }
-            }
-            break;
-        case 0x5:
-            fprintf(stderr, "bitmap mode 5 not implemented yet\n");
-            exit(1);
-
-        default:
-            fprintf(stderr, "PPU Error: invalid video mode\n", DCNT_MODE);
-            exit(1);
+        if (!DCNT_WIN0 && !DCNT_WIN1 && !DCNT_WINOBJ && (BLDCNT_EFFECT == EFFECT_NONE) && !BGCNT_MOSAIC(REG_BG2CNT)) {
+            if (DCNT_MODE == 0x5)
+                render_backdrop();
+            render_bitmap_bg(gba->frame[view->vcount], NULL);
+            gba->frame_stats.layers_rendered++;
+            return;
+        }
+
+        render_bitmap_bg(bg_line[2], bg_opaque[2]);
+        if (BGCNT_MOSAIC(REG_BG2CNT) && (MOSAIC_BG_H > 1))
+            apply_mosaic(2);
+        gba->frame_stats.layers_rendered++;
+        break;
+
+    default:
+        fprintf(stderr, "PPU Error: invalid video mode %d\n", DCNT_MODE);
+        gba_fatal();
+    }
+
+    compute_window_masks();
+
+    if (DCNT_MODE <= 0x2)
+        bg_mask = render_tiled_bgs(bg_mask);
+
+    composite_bgs(bg_mask);
+}
+
+static void *render_thread_loop(void *arg) {
+    gba = arg;
+    view = &gba->render_view;
+
+    while (true) {
+        uint32_t head = __atomic_load_n(&gba->scanline_head, __ATOMIC_ACQUIRE);
+        if (gba->scanline_tail == head) {
+            if (!__atomic_load_n(&gba->threaded_ppu_enabled, __ATOMIC_ACQUIRE))
+                return NULL;
+            sched_yield();
+            continue;
+        }
+
+        ScanlineSnapshot *snapshot = &gba->scanline_queue[gba->scanline_tail & (SCANLINE_QUEUE_SIZE - 1)];
+
+        // bring the private copy of memory up to date with the emulation thread at this scanline
+        for (uint32_t i = gba->diff_tail; i != snapshot->diff_end; i++) {
+            DiffBlock *block = &gba->diff_ring[i & (DIFF_RING_SIZE - 1)];
+            memcpy((uint8_t *)&gba->render_memory + block->offset, block->data, DIFF_BLOCK_SIZE);
+
+            if (block->offset < sizeof(gba->render_memory.vram))
+                MARK_VRAM_DIRTY_IN(gba->render_memory.vram_dirty, block->offset);
+        }
+        __atomic_store_n(&gba->diff_tail, snapshot->diff_end, __ATOMIC_RELEASE);
+
+        memcpy(gba->render_memory.mmio, snapshot->mmio, sizeof(gba->render_memory.mmio));
+        gba->render_view.vcount = snapshot->vcount;
+        memcpy(gba->render_view.bg_ref_x, snapshot->bg_ref_x, sizeof(gba->render_view.bg_ref_x));
+        memcpy(gba->render_view.bg_ref_y, snapshot->bg_ref_y, sizeof(gba->render_view.bg_ref_y));
+
+        render_scanline();
+
+        __atomic_store_n(&gba->scanline_tail, gba->scanline_tail + 1, __ATOMIC_RELEASE);
+    }
+}
+
+static void push_diff_block(uint32_t offset, uint8_t *src) {
+    // the render thread frees up space as it catches up on earlier scanlines
+    while ((gba->diff_head - __atomic_load_n(&gba->diff_tail, __ATOMIC_ACQUIRE)) == DIFF_RING_SIZE)
+        sched_yield();
+
+    DiffBlock *block = &gba->diff_ring[gba->diff_head & (DIFF_RING_SIZE - 1)];
+    block->offset = offset;
+    memcpy(block->data, src, DIFF_BLOCK_SIZE);
+    gba->diff_head++;
+}
+
+// hands the current scanline over to the render thread, along with every block of vram and
+// pallete ram written since the previous one
+static void push_scanline_snapshot(void) {
+    for (int word = 0; word < VRAM_DIRTY_WORDS; word++) {
+        uint64_t dirty = gba->vram_dirty[word];
+        gba->vram_dirty[word] = 0;
+
+        while (dirty) {
+            uint32_t offset = ((word * 64) + __builtin_ctzll(dirty)) * DIFF_BLOCK_SIZE;
+            dirty &= dirty - 1;
+            push_diff_block(offsetof(RenderMemory, vram) + offset, gba->vram + offset);
+        }
+    }
+
+    while (gba->pallete_dirty) {
+        uint32_t offset = __builtin_ctz(gba->pallete_dirty) * DIFF_BLOCK_SIZE;
+        gba->pallete_dirty &= gba->pallete_dirty - 1;
+        push_diff_block(offsetof(RenderMemory, pallete_ram) + offset, gba->pallete_ram + offset);
+    }
+
+    while ((gba->scanline_head - __atomic_load_n(&gba->scanline_tail, __ATOMIC_ACQUIRE)) == SCANLINE_QUEUE_SIZE)
+        sched_yield();
+
+    ScanlineSnapshot *snapshot = &gba->scanline_queue[gba->scanline_head & (SCANLINE_QUEUE_SIZE - 1)];
+    snapshot->vcount = gba->reg_vcount;
+    memcpy(snapshot->mmio, gba->ppu_mmio, sizeof(snapshot->mmio));
+    memcpy(snapshot->bg_ref_x, gba->live_view.bg_ref_x, sizeof(snapshot->bg_ref_x));
+    memcpy(snapshot->bg_ref_y, gba->live_view.bg_ref_y, sizeof(snapshot->bg_ref_y));
+    snapshot->diff_end = gba->diff_head;
+
+    __atomic_store_n(&gba->scanline_head, gba->scanline_head + 1, __ATOMIC_RELEASE);
+}
+
+void catch_up_ppu(void) {
+    double start = gba->profiling_enabled ? gba_now_seconds() : 0;
+    view = &gba->pending_view;
+
+    // nothing visible changed since the first pending scanline, so the affine reference
+    // points can be stepped forward with the current PB/PD
+    for (; gba->ppu_pending_lines > 0; gba->ppu_pending_lines--) {
+        render_scanline();
+
+        gba->pending_view.vcount++;
+        for (int bg = 2; bg < 4; bg++) {
+            gba->pending_view.bg_ref_x[bg - 2] += (int16_t)REG_BGPB(bg);
+            gba->pending_view.bg_ref_y[bg - 2] += (int16_t)REG_BGPD(bg);
+        }
+    }
+
+    view = &gba->live_view;
+    if (gba->profiling_enabled)
+        gba->profile.ppu_draw_seconds += gba_now_seconds() - start;
+}
+
+void enable_catch_up_ppu(bool enable) {
+    catch_up_ppu();
+    gba->catch_up_enabled = enable;
+}
+
+// draws every scanline so far into the frame, deferred or queued for the render thread
+void sync_ppu(void) {
+    catch_up_ppu();
+
+    double start = gba->profiling_enabled ? gba_now_seconds() : 0;
+    if (gba->threaded_ppu_enabled)
+        while (__atomic_load_n(&gba->scanline_tail, __ATOMIC_ACQUIRE) != gba->scanline_head)
+            sched_yield();
+    if (gba->profiling_enabled)
+        gba->profile.ppu_draw_seconds += gba_now_seconds() - start;
+}
+
+// after the machine state was overwritten (by loading a savestate): the live view is pointed back at
+// this instance, and everything is marked as written so that caches, the render thread's copy and
+// static frame detection all start over. the PPU has to be synced beforehand
+void invalidate_ppu(void) {
+    invalidate_ppu_vram(0, sizeof(gba->vram));
+}
+
+// the same, for when only part of vram was overwritten
+void invalidate_ppu_vram(uint32_t offset, uint32_t size) {
+    gba->live_view.vram = gba->vram;
+    gba->live_view.pallete_ram = gba->pallete_ram;
+    gba->live_view.mmio = gba->ppu_mmio;
+    gba->live_view.vram_dirty = gba->vram_dirty;
+
+    for (uint32_t block = offset & ~(DIFF_BLOCK_SIZE - 1); block < offset + size; block += DIFF_BLOCK_SIZE)
+        MARK_VRAM_DIRTY(block);
+    gba->pallete_dirty = ~UINT32_C(0);
+    gba->ppu_state_written = true;
+    gba->frame_is_static = false;
+}
+
+void flush_ppu(void) {
+    sync_ppu();
+
+    // nothing is being rendered anymore, so the counts can be handed out
+    gba->ppu_stats = gba->frame_stats;
+    memset(&gba->frame_stats, 0, sizeof(gba->frame_stats));
+}
+
+void enable_threaded_ppu(bool enable) {
+    if (enable == gba->threaded_ppu_enabled) return;
+
+    if (enable) {
+        // the render thread starts out from a full copy of the current state
+        memcpy(gba->render_memory.vram, gba->vram, sizeof(gba->render_memory.vram));
+        memcpy(gba->render_memory.pallete_ram, gba->pallete_ram, sizeof(gba->render_memory.pallete_ram));
+        memset(gba->vram_dirty, 0, sizeof(gba->vram_dirty));
+        memset(gba->render_memory.vram_dirty, 0xFF, sizeof(gba->render_memory.vram_dirty));
+        gba->pallete_dirty = 0;
+
+        gba->threaded_ppu_enabled = true;
+        if (pthread_create(&gba->render_thread, NULL, render_thread_loop, gba) != 0) {
+            fprintf(stderr, "PPU Error: failed to start render thread\n");
+            gba_fatal();
         }
     } else {
-        for (int i = 0; i < 240; i++) // no rendering bits enabled: render backdrop (first entry in pallete RAM)
-            frame[reg_vcount][i] = *(uint16_t *)pallete_ram;
+        flush_ppu();
+        __atomic_store_n(&gba->threaded_ppu_enabled, false, __ATOMIC_RELEASE);
+        pthread_join(gba->render_thread, NULL);
+
+        // anything written while the render thread was running is still marked dirty in vram_dirty
+        memset(gba->vram_dirty, 0xFF, sizeof(gba->vram_dirty));
+    }
+}
+
+// points the views at the current instance's memory and sets up everything that doesn't start out as 0
+void init_ppu(void) {
+    gba->live_view = (PpuView){ .vram = gba->vram, .pallete_ram = gba->pallete_ram, .mmio = gba->ppu_mmio, .vram_dirty = gba->vram_dirty };
+    gba->pending_view = gba->live_view;
+    gba->render_view = (PpuView){
+        .vram = gba->render_memory.vram,
+        .pallete_ram = gba->render_memory.pallete_ram,
+        .mmio = gba->render_memory.mmio,
+        .vram_dirty = gba->render_memory.vram_dirty,
+    };
+
+    gba->frame_skip_period = 1;
+    gba->next_frame_skip_period = 1;
+    gba->rendering_frame = true;
+    gba->ppu_state_written = true;
+}
+
+static void begin_frame(void) {
+    if (gba->frame_skip_changed) {
+        gba->frame_skip = gba->next_frame_skip;
+        gba->frame_skip_period = gba->next_frame_skip_period;
+        gba->frame_skip_phase = 0;
+        gba->frame_skip_changed = false;
+    }
+
+    gba->rendering_frame = !gba->rendering_paused && !gba->skip_next_frame_requested && (gba->frame_skip_phase < (gba->frame_skip_period - gba->frame_skip));
+    gba->frame_skip_phase = (gba->frame_skip_phase + 1) % gba->frame_skip_period;
+    gba->skip_next_frame_requested = false;
+}
+
+void set_frame_skip(int skip, int period) {
+    if ((period < 1) || (skip < 0) || (skip > period)) {
+        fprintf(stderr, "PPU Error: invalid frame skip %d/%d\n", skip, period);
+        gba_fatal();
+    }
+
+    gba->next_frame_skip = skip;
+    gba->next_frame_skip_period = period;
+    gba->frame_skip_changed = true;
+
+    // changing whether a frame is drawn part way through it would leave it half drawn, so the new
+    // setting waits for the next frame to begin. the current one can still take it before its first
+    // scanline (at power on or after a reset)
+    if ((gba->reg_vcount == 0) && (gba->cycles < 32))
+        begin_frame();
+}
+
+// the next frame to reach vblank isn't drawn. a frame run covers exactly one frame's worth of cycles
+// but isn't aligned to vblank, so that frame may already be being drawn, in which case the rest of it
+// is dropped (it counts as skipped all the same). otherwise it's skipped once it begins
+void skip_next_frame(void) {
+    if (gba->reg_vcount < FRAME_HEIGHT)
+        gba->rendering_frame = false;
+    else
+        gba->skip_next_frame_requested = true;
+}
+
+// while paused the rest of the current frame and every frame after it is left undrawn. resuming only
+// takes effect from the next frame to begin, which (as a frame begins on the last cycle of the run
+// before the one that draws it) is drawn by the run after next
+void pause_rendering(bool pause) {
+    gba->rendering_paused = pause;
+    if (pause)
+        gba->rendering_frame = false;
+}
+
+void reload_bg_ref_point(uint32_t offset) {
+    switch (offset & ~3) {
+    case 0x28: gba->live_view.bg_ref_x[0] = AFFINE_REF(REG_BG2X); break;
+    case 0x2C: gba->live_view.bg_ref_y[0] = AFFINE_REF(REG_BG2Y); break;
+    case 0x38: gba->live_view.bg_ref_x[1] = AFFINE_REF(REG_BG3X); break;
+    case 0x3C: gba->live_view.bg_ref_y[1] = AFFINE_REF(REG_BG3Y); break;
     }
 }
 
 void tick_ppu(void) {
-    cycles += 1;
+    gba->cycles += 1;
 
     // vblank
-    if (reg_vcount >= FRAME_HEIGHT) {
+    if (gba->reg_vcount >= FRAME_HEIGHT) {
         REG_DISPSTAT |= 3;
 
-        if ((cycles % CYCLES_PER_SCANLINE) == 0) {
-            if (++reg_vcount == 228) {
+        if ((gba->cycles % CYCLES_PER_SCANLINE) == 0) {
+            if (++gba->reg_vcount == 228) {
                 REG_DISPSTAT &= ~3;
-                cycles = 0;
-                reg_vcount = 0;
+                gba->cycles = 0;
+                gba->reg_vcount = 0;
+
+                bool previous_frame_drawn = gba->rendering_frame;
+                begin_frame();
+                gba->frame_is_static = previous_frame_drawn && gba->rendering_frame && !gba->ppu_state_written;
+                gba->ppu_state_written = false;
             };
         }
         return;
@@ -260,15 +1160,56 @@ void tick_ppu(void) {
 
     // from "research" seems like rendering 32 cycles into hdraw 
     // creates best results for scanline PPU
-    if (cycles == 32) 
-        render_scanline();
+    if ((gba->cycles == 32) && gba->rendering_frame) {
+        double start = gba->profiling_enabled ? gba_now_seconds() : 0;
 
-    if (cycles == 1006) // start of hblank
+        // once anything is written the rest of the frame is drawn as usual
+        gba->frame_is_static &= !gba->ppu_state_written;
+
+        if (gba->frame_is_static) {
+            // the frame buffer already holds this scanline from the previous frame
+        } else if (gba->threaded_ppu_enabled) {
+            push_scanline_snapshot();
+        } else if (gba->catch_up_enabled) {
+            if (gba->ppu_pending_lines == 0) {
+                gba->pending_view.vcount = gba->reg_vcount;
+                memcpy(gba->pending_view.bg_ref_x, gba->live_view.bg_ref_x, sizeof(gba->pending_view.bg_ref_x));
+                memcpy(gba->pending_view.bg_ref_y, gba->live_view.bg_ref_y, sizeof(gba->pending_view.bg_ref_y));
+            }
+            gba->ppu_pending_lines++;
+        } else {
+            gba->live_view.vcount = gba->reg_vcount;
+            view = &gba->live_view;
+            render_scanline();
+        }
+
+        if (gba->profiling_enabled)
+            gba->profile.ppu_draw_seconds += gba_now_seconds() - start;
+    }
+
+    if (gba->cycles == 1006) // start of hblank
         REG_DISPSTAT |= 2;
 
-    if (cycles == CYCLES_PER_SCANLINE) {
+    if (gba->cycles == CYCLES_PER_SCANLINE) {
         REG_DISPSTAT &= ~3;   // hdraw and vdraw will start next cycle
-        cycles = 0;
-        reg_vcount += 1;
+        gba->cycles = 0;
+        gba->reg_vcount += 1;
+
+        // affine reference points advance by (PB, PD) after every drawn scanline
+        // and are reloaded from BGxX/BGxY once vblank is entered
+        if (gba->reg_vcount == FRAME_HEIGHT) {
+            CATCH_UP_PPU();
+            gba->is_frame_skipped = !gba->rendering_frame;
+            gba->is_frame_unchanged = gba->rendering_frame && gba->frame_is_static;
+            reload_bg_ref_point(0x28);
+            reload_bg_ref_point(0x2C);
+            reload_bg_ref_point(0x38);
+            reload_bg_ref_point(0x3C);
+        } else {
+            gba->live_view.bg_ref_x[0] += (int16_t)REG_BG2PB;
+            gba->live_view.bg_ref_y[0] += (int16_t)REG_BG2PD;
+            gba->live_view.bg_ref_x[1] += (int16_t)REG_BG3PB;
+            gba->live_view.bg_ref_y[1] += (int16_t)REG_BG3PD;
+        }
     }
 };
@@ -1,18 +1,102 @@
 #ifndef PPU_H
 #define PPU_H
 
+#include <stdint.h>
 #include <stdbool.h>
 
-extern uint16_t frame[160][240];
+#define FRAME_WIDTH  240
+#define FRAME_HEIGHT 160
 
-extern uint8_t vram[0x18000];
-extern uint8_t oam[0x400];
-extern uint8_t pallete_ram[0x400];
-extern uint8_t ppu_mmio[0x56];
-extern uint8_t reg_vcount;
+#define VRAM_DIRTY_WORDS (0x18000 >> 11)
 
-extern bool is_rendering_bitmap;
+// sizes of the render thread queues (both must be powers of 2). the diff ring must hold at
+// least one scanline worth of changes, which is every block of vram and pallete ram
+#define SCANLINE_QUEUE_SIZE 256
+#define DIFF_RING_SIZE      0x2000
+#define DIFF_BLOCK_SIZE     32
 
+// a text background pre-rendered in full (up to 512x512) as pallete indices, so scanlines become a
+// wrapped copy at the scroll offset. indices (0 when transparent) are cached instead of colors so
+// pallete writes don't invalidate anything. screen entries are re-rendered lazily once dirty
+typedef struct {
+    bool valid;
+    uint16_t layout;                // BGCNT bits the cached pixels depend on
+    bool entry_dirty[64 * 64];      // indexed by screen entry, in vram order
+    bool tiles_changed;
+    bool tile_changed[1024];        // tile ids whose pixel data was written since the last sync
+    uint8_t pixels[512][512];
+} BgCache;
+
+// everything a scanline is rendered from. on the emulation thread this is the live memory,
+// on the render thread it is a private copy kept in sync through scanline snapshots
+typedef struct {
+    uint8_t *vram;
+    uint8_t *pallete_ram;
+    uint8_t *mmio;
+    uint64_t *vram_dirty;
+    uint8_t vcount;
+
+    // internal reference point latches for the affine backgrounds (index 0 is BG2, 1 is BG3).
+    // these are copied from BGxX/BGxY at vblank or when written, and stepped by PB/PD every scanline
+    int32_t bg_ref_x[2];
+    int32_t bg_ref_y[2];
+} PpuView;
+
+// registers and latches for one scanline, queued for the render thread. diff_end is the position
+// in the diff ring up to which memory changes have to be applied before the scanline is drawn
+typedef struct {
+    uint8_t vcount;
+    uint8_t mmio[0x56];
+    int32_t bg_ref_x[2];
+    int32_t bg_ref_y[2];
+    uint32_t diff_end;
+} ScanlineSnapshot;
+
+// a 32 byte block of vram or pallete ram (offset is into RenderMemory) that changed since the last snapshot
+typedef struct {
+    uint32_t offset;
+    uint8_t data[DIFF_BLOCK_SIZE];
+} DiffBlock;
+
+typedef struct {
+    uint8_t vram[0x18000];
+    uint8_t pallete_ram[0x400];
+    uint8_t mmio[0x56];
+    uint64_t vram_dirty[VRAM_DIRTY_WORDS];
+} RenderMemory;
+
+// rendering work done up to the last flush_ppu() (once per frame run)
+typedef struct {
+    uint32_t lines_rendered;
+    uint32_t layers_rendered; // background scanlines drawn
+    uint32_t layers_culled;   // background scanlines skipped since the layers in front covered them
+    uint32_t tiles_culled;    // tile rows skipped within the text background scanlines that were drawn
+} PpuStats;
+
+// vram and pallete ram are tracked in 32 byte blocks, so cached backgrounds only redraw
+// and the render thread is only sent what was written
+#define MARK_VRAM_DIRTY_IN(bitmap, offset) ((bitmap)[(offset) >> 11] |= UINT64_C(1) << (((offset) >> 5) & 63))
+#define MARK_VRAM_DIRTY(offset) MARK_VRAM_DIRTY_IN(gba->vram_dirty, offset)
+#define MARK_PALLETE_DIRTY(offset) (gba->pallete_dirty |= UINT32_C(1) << ((offset) >> 5))
+
+// with the catch-up renderer, scanlines deferred so far have to be drawn before
+// anything the PPU reads from is written
+#define CATCH_UP_PPU() if (gba->ppu_pending_lines) catch_up_ppu();
+
+// these all act on the calling thread's current instance (see gba.h)
+void init_ppu(void);
+void set_frame_skip(int skip, int period);
+void skip_next_frame(void);
+void pause_rendering(bool pause);
+void enable_bg_cache(bool enable);
+void enable_threaded_ppu(bool enable);
+void enable_catch_up_ppu(bool enable);
+void catch_up_ppu(void);
+void sync_ppu(void);
+void invalidate_ppu(void);
+void invalidate_ppu_vram(uint32_t offset, uint32_t size);
+void flush_ppu(void);
+void reload_bg_ref_point(uint32_t offset);
 void tick_ppu(void);
 
 #endif
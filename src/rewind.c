@@ -0,0 +1,208 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "rewind.h"
+
+// changed bytes separated by fewer unchanged ones than this are stored as a single run
+#define MIN_UNCHANGED_RUN 8
+
+// the most a delta of size bytes can take: every run but the first is preceded by at least
+// MIN_UNCHANGED_RUN unchanged bytes, and its two lengths take at most 10 bytes
+#define MAX_ENCODED_SIZE(size) ((size) + (((size) / MIN_UNCHANGED_RUN) + 1) * 10)
+
+// a delta between identical snapshots (a static screen) takes no space in the ring, so eviction by
+// size alone would never drop it. the number of deltas is capped as well (~73 minutes at 4 frames each)
+#define MAX_DELTAS (1 << 16)
+
+Rewind *rewind_create(size_t ring_size, int interval) {
+    Rewind *rewind = calloc(1, sizeof(Rewind));
+    if (rewind == NULL) {
+        fprintf(stderr, "ERROR: failed to allocate the rewind buffer\n");
+        gba_fatal();
+    }
+
+    rewind->interval = interval;
+    rewind->snapshot = malloc(SAVESTATE_SIZE);
+    rewind->next_snapshot = malloc(SAVESTATE_SIZE);
+    rewind->encoded = malloc(MAX_ENCODED_SIZE(SAVESTATE_SIZE));
+    rewind->ring = malloc(ring_size);
+    rewind->ring_size = ring_size;
+    rewind->max_deltas = 256;
+    rewind->deltas = malloc(rewind->max_deltas * sizeof(RewindDelta));
+
+    if ((rewind->snapshot == NULL) || (rewind->next_snapshot == NULL) || (rewind->encoded == NULL) || (rewind->ring == NULL) || (rewind->deltas == NULL)) {
+        fprintf(stderr, "ERROR: failed to allocate the rewind buffer\n");
+        gba_fatal();
+    }
+
+    return rewind;
+}
+
+void rewind_destroy(Rewind *rewind) {
+    free(rewind->snapshot);
+    free(rewind->next_snapshot);
+    free(rewind->encoded);
+    free(rewind->ring);
+    free(rewind->deltas);
+    free(rewind);
+}
+
+static uint8_t *put_length(uint8_t *out, size_t length) {
+    while (length >= 0x80) {
+        *out++ = (length & 0x7F) | 0x80;
+        length >>= 7;
+    }
+    *out++ = length;
+    return out;
+}
+
+static const uint8_t *get_length(const uint8_t *in, size_t *length) {
+    *length = 0;
+    for (int shift = 0; ; shift += 7) {
+        *length |= (size_t)(*in & 0x7F) << shift;
+        if (!(*in++ & 0x80)) return in;
+    }
+}
+
+// a ^ b as a series of runs: the number of unchanged (zero) bytes to skip, the number of changed
+// bytes, and then the changed bytes themselves
+static size_t encode_delta(uint8_t *out, const uint8_t *a, const uint8_t *b, size_t size) {
+    uint8_t *start = out;
+    size_t pos = 0;
+
+    for (;;) {
+        size_t run_start = pos;
+
+        // most of the state doesn't change between snapshots, so skip it a word at a time
+        uint64_t word_a, word_b;
+        for (; pos + 8 <= size; pos += 8) {
+            memcpy(&word_a, a + pos, 8);
+            memcpy(&word_b, b + pos, 8);
+            if (word_a != word_b) break;
+        }
+        while ((pos < size) && (a[pos] == b[pos]))
+            pos++;
+
+        if (pos == size)
+            break;
+
+        size_t end = pos;
+        int unchanged = 0;
+        while ((end < size) && (unchanged < MIN_UNCHANGED_RUN)) {
+            unchanged = (a[end] == b[end]) ? unchanged + 1 : 0;
+            end++;
+        }
+        end -= unchanged;
+
+        out = put_length(out, pos - run_start);
+        out = put_length(out, end - pos);
+        for (; pos < end; pos++)
+            *out++ = a[pos] ^ b[pos];
+    }
+
+    return out - start;
+}
+
+static void apply_delta(uint8_t *state, const uint8_t *delta, size_t delta_size) {
+    const uint8_t *end = delta + delta_size;
+    size_t pos = 0;
+
+    while (delta < end) {
+        size_t skip, length;
+        delta = get_length(delta, &skip);
+        delta = get_length(delta, &length);
+
+        pos += skip;
+        for (size_t i = 0; i < length; i++)
+            state[pos++] ^= *delta++;
+    }
+}
+
+static void drop_oldest_delta(Rewind *rewind) {
+    rewind->first_delta = (rewind->first_delta + 1) % rewind->max_deltas;
+    rewind->num_deltas--;
+}
+
+static void store_delta(Rewind *rewind, const uint8_t *delta, size_t size) {
+    if (size > rewind->ring_size) {
+        rewind->num_deltas = 0;
+        rewind->write_offset = 0;
+        return;
+    }
+
+    // deltas are laid out in the order they were stored, so the ones in the way of the new one are
+    // always the oldest. when it doesn't fit before the end of the ring it goes at the start, and
+    // everything past the write offset goes first
+    bool wrapped = rewind->write_offset + size > rewind->ring_size;
+    size_t offset = wrapped ? 0 : rewind->write_offset;
+
+    while (rewind->num_deltas > 0) {
+        RewindDelta *oldest = &rewind->deltas[rewind->first_delta];
+        bool in_skipped_end = wrapped && (oldest->offset >= rewind->write_offset);
+        bool overlaps = (oldest->offset >= offset) && (oldest->offset < offset + size);
+        if (!in_skipped_end && !overlaps) break;
+
+        drop_oldest_delta(rewind);
+    }
+    if (rewind->num_deltas == MAX_DELTAS)
+        drop_oldest_delta(rewind);
+
+    if (rewind->num_deltas == rewind->max_deltas) {
+        RewindDelta *deltas = malloc(2 * rewind->max_deltas * sizeof(RewindDelta));
+        if (deltas == NULL) {
+            fprintf(stderr, "ERROR: failed to allocate the rewind buffer\n");
+            gba_fatal();
+        }
+
+        for (int i = 0; i < rewind->num_deltas; i++)
+            deltas[i] = rewind->deltas[(rewind->first_delta + i) % rewind->max_deltas];
+
+        free(rewind->deltas);
+        rewind->deltas = deltas;
+        rewind->first_delta = 0;
+        rewind->max_deltas *= 2;
+    }
+
+    memcpy(rewind->ring + offset, delta, size);
+    rewind->deltas[(rewind->first_delta + rewind->num_deltas) % rewind->max_deltas] = (RewindDelta){ offset, size };
+    rewind->num_deltas++;
+    rewind->write_offset = offset + size;
+}
+
+void rewind_frame(Rewind *rewind, GBA *instance) {
+    if (rewind->has_snapshot && (++rewind->frames_since_snapshot < rewind->interval))
+        return;
+
+    gba_save_state(instance, rewind->next_snapshot);
+
+    if (rewind->has_snapshot)
+        store_delta(rewind, rewind->encoded, encode_delta(rewind->encoded, rewind->snapshot, rewind->next_snapshot, SAVESTATE_SIZE));
+
+    uint8_t *previous = rewind->snapshot;
+    rewind->snapshot = rewind->next_snapshot;
+    rewind->next_snapshot = previous;
+
+    rewind->has_snapshot = true;
+    rewind->frames_since_snapshot = 0;
+}
+
+bool rewind_step_back(Rewind *rewind, GBA *instance) {
+    if (!rewind->has_snapshot)
+        return false;
+
+    if (rewind->frames_since_snapshot == 0) {
+        if (rewind->num_deltas == 0)
+            return false;
+
+        // the space of the newest delta is free again once it has been undone
+        RewindDelta *newest = &rewind->deltas[(rewind->first_delta + rewind->num_deltas - 1) % rewind->max_deltas];
+        apply_delta(rewind->snapshot, rewind->ring + newest->offset, newest->size);
+        rewind->write_offset = newest->offset;
+        rewind->num_deltas--;
+    }
+
+    gba_load_state(instance, rewind->snapshot, SAVESTATE_SIZE);
+    rewind->frames_since_snapshot = 0;
+
+    return true;
+}
@@ -0,0 +1,48 @@
+#ifndef REWIND_H
+#define REWIND_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "gba.h"
+
+// where a delta is in the ring
+typedef struct {
+    size_t offset;
+    size_t size;
+} RewindDelta;
+
+// rewind history. a savestate is taken every interval frames, but only the newest one is kept in
+// full: each older one is stored as its XOR with the one after it, run length encoded, and
+// recovered by undoing deltas from the newest backwards. deltas are packed into a fixed size ring
+// and the oldest ones are dropped once it's full
+typedef struct {
+    int interval;
+    int frames_since_snapshot;
+    bool has_snapshot;
+
+    uint8_t *snapshot; // the newest snapshot
+    uint8_t *next_snapshot;
+    uint8_t *encoded; // the delta being stored
+
+    uint8_t *ring;
+    size_t ring_size;
+    size_t write_offset;
+
+    RewindDelta *deltas; // circular, oldest first
+    int first_delta;
+    int num_deltas;
+    int max_deltas;
+} Rewind;
+
+Rewind *rewind_create(size_t ring_size, int interval);
+void rewind_destroy(Rewind *rewind);
+
+// called after every frame run
+void rewind_frame(Rewind *rewind, GBA *instance);
+
+// loads the newest snapshot if any frames ran since it was taken, otherwise the one before it.
+// returns false once there's no history left
+bool rewind_step_back(Rewind *rewind, GBA *instance);
+
+#endif